@@ -0,0 +1,114 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "../../Source/SamplerAudioProcessor.h"
+
+//==============================================================================
+// Shared set-up for the benchmarks. Each benchmark is a juce::UnitTest in the
+// "Benchmarks" category, and reports its timings with logMessage().
+// Timings are the median over a number of blocks, so that the odd slow block
+// (e.g. a page fault or a context switch) doesn't skew them.
+namespace Benchmarks
+{
+    constexpr double sampleRate = 48000.0;
+    constexpr int blockSize = 512;
+
+    // A stereo pair of sines, or just the left one for mono.
+    inline std::vector<std::vector<float>> makeTestSample(int numChannels, double seconds, float frequency = 220.0f)
+    {
+        const auto numFrames = (size_t)(seconds * sampleRate);
+        std::vector<std::vector<float>> data((size_t)numChannels, std::vector<float>(numFrames));
+
+        for (size_t chan = 0; chan < data.size(); ++chan)
+        {
+            const auto delta = juce::MathConstants<double>::twoPi * frequency * (double)(chan + 2) / 2.0 / sampleRate;
+
+            for (size_t i = 0; i < numFrames; ++i)
+                data[chan][i] = 0.5f * (float)std::sin(delta * (double)i);
+        }
+
+        return data;
+    }
+
+    // A processor with a looping test sample and an MPE lower zone over all
+    // 15 member channels, ready to render.
+    inline std::unique_ptr<SamplerAudioProcessor> makeProcessor(int numVoices,
+        std::vector<std::vector<float>> sampleData = makeTestSample(2, 10.0),
+        SampleLayout layout = SampleLayout::planar)
+    {
+        auto processor = std::make_unique<SamplerAudioProcessor>(jmax(numVoices, 1));
+        processor->setRateAndBufferSizeDetails(sampleRate, blockSize);
+        processor->setSampleLayout(layout);
+        processor->setSample(std::move(sampleData), sampleRate);
+        processor->setLoopMode(LoopMode::forward);
+        processor->setNumberOfVoices(numVoices);
+
+        MPEZoneLayout zones;
+        zones.setLowerZone(15);
+        processor->setMPEZoneLayout(zones);
+
+        processor->prepareToPlay(sampleRate, blockSize);
+
+        // Applies everything above.
+        juce::AudioBuffer<float> buffer(2, blockSize);
+        MidiBuffer midi;
+        processor->processBlock(buffer, midi);
+
+        return processor;
+    }
+
+    // Starts a note on each (channel, note number) pair, all at the start of
+    // one block.
+    inline void startNotes(SamplerAudioProcessor& processor, const std::vector<std::pair<int, int>>& notes)
+    {
+        juce::AudioBuffer<float> buffer(2, blockSize);
+        MidiBuffer midi;
+
+        for (auto& note : notes)
+            midi.addEvent(MidiMessage::noteOn(note.first, note.second, (juce::uint8)100), 0);
+
+        processor.processBlock(buffer, midi);
+    }
+
+    // Renders numBlocks blocks, with makeMidi(midi, blockIndex) filling in the
+    // MIDI for each one, and returns the median time per block in
+    // microseconds. Building the MIDI isn't timed.
+    template <typename MakeMidi>
+    double timeBlocks(SamplerAudioProcessor& processor, int numBlocks, MakeMidi&& makeMidi)
+    {
+        juce::AudioBuffer<float> buffer(2, blockSize);
+        MidiBuffer midi;
+        std::vector<double> times;
+        times.reserve((size_t)numBlocks);
+
+        for (auto block = 0; block < numBlocks; ++block)
+        {
+            midi.clear();
+            makeMidi(midi, block);
+
+            const auto start = juce::Time::getHighResolutionTicks();
+            processor.processBlock(buffer, midi);
+            const auto end = juce::Time::getHighResolutionTicks();
+
+            times.push_back(juce::Time::highResolutionTicksToSeconds(end - start) * 1.0e6);
+        }
+
+        std::nth_element(times.begin(), times.begin() + (std::ptrdiff_t)(times.size() / 2), times.end());
+        return times[times.size() / 2];
+    }
+}
@@ -0,0 +1,43 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+
+//==============================================================================
+// Runs every benchmark, or only the ones named on the command line, e.g.
+//     SamplerBenchmarks "Note dispatch"
+// Build the Release configuration, since Debug timings mean very little.
+int main(int argc, char* argv[])
+{
+    // The processor needs a message manager, e.g. for its parameters.
+    juce::ScopedJuceInitialiser_GUI juceInitialiser;
+
+    const juce::StringArray names(argv + 1, argc - 1);
+    juce::Array<juce::UnitTest*> benchmarks;
+
+    for (auto* test : juce::UnitTest::getTestsInCategory("Benchmarks"))
+        if (names.isEmpty() || names.contains(test->getName(), true))
+            benchmarks.add(test);
+
+    juce::UnitTestRunner runner;
+    runner.setAssertOnFailure(false);
+    runner.runTests(benchmarks);
+
+    for (auto i = 0; i < runner.getNumResults(); ++i)
+        if (runner.getResult(i)->failures > 0)
+            return 1;
+
+    return 0;
+}
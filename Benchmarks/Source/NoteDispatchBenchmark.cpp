@@ -0,0 +1,101 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#include "BenchmarkUtilities.h"
+
+//==============================================================================
+// How long it takes to route a per-note MPE message (pitchbend, pressure or
+// timbre) to its voice, as the number of sounding voices grows.
+// A few notes, one per channel, receive a dense stream of controller
+// messages. All the other voices play on channels that never receive any, so
+// every message touches the same number of notes whatever the polyphony.
+// The synthesiser finds a note's voice through its index, so its own share
+// of the cost stays flat. MPEInstrument still looks through all of its notes
+// for the ones on the message's channel before the synthesiser hears about
+// it, so the total still grows with the voice count, though only by a short
+// loop per note rather than by a search through every voice per note.
+// The messages all arrive at the start of the block, so they don't split
+// the render, and the render itself is timed separately and taken off.
+class NoteDispatchBenchmark final : public juce::UnitTest
+{
+public:
+    NoteDispatchBenchmark()
+        : juce::UnitTest("Note dispatch", "Benchmarks")
+    {
+    }
+
+    void runTest() override
+    {
+        for (auto numVoices : { 16, 64, 256, 1024 })
+        {
+            beginTest(juce::String(numVoices) + " voices");
+
+            auto processor = Benchmarks::makeProcessor(numVoices);
+            Benchmarks::startNotes(*processor, makeNotes(numVoices));
+
+            const auto withoutMessages = Benchmarks::timeBlocks(*processor, numBlocks, [](MidiBuffer&, int) {});
+            const auto withMessages = Benchmarks::timeBlocks(*processor, numBlocks, addControllerMessages);
+            const auto nanosPerMessage = jmax(0.0, withMessages - withoutMessages) * 1000.0 / messagesPerBlock;
+
+            expect(withoutMessages > 0.0);
+            logMessage(juce::String::formatted("%5d voices: %8.1f ns per message (%.1f us per block without messages)",
+                numVoices, nanosPerMessage, withoutMessages));
+        }
+    }
+
+private:
+    enum
+    {
+        numBlocks = 200,
+        messagesPerBlock = 512,
+
+        // Channels 2 to 5 carry one note each and receive all the messages.
+        firstTargetChannel = 2,
+        numTargetChannels = 4
+    };
+
+    // One note on each target channel, then the rest of the voices spread
+    // over the other member channels, up to 128 notes each.
+    static std::vector<std::pair<int, int>> makeNotes(int numVoices)
+    {
+        std::vector<std::pair<int, int>> notes;
+
+        for (auto i = 0; i < numTargetChannels; ++i)
+            notes.push_back({ firstTargetChannel + i, 60 });
+
+        for (auto i = 0; (int)notes.size() < numVoices; ++i)
+            notes.push_back({ firstTargetChannel + numTargetChannels + i / 128, i % 128 });
+
+        return notes;
+    }
+
+    static void addControllerMessages(MidiBuffer& midi, int block)
+    {
+        for (auto i = 0; i < messagesPerBlock; ++i)
+        {
+            const auto channel = firstTargetChannel + i % numTargetChannels;
+            const auto value = (block * messagesPerBlock + i) % 128;
+
+            switch (i / numTargetChannels % 3)
+            {
+            case 0:  midi.addEvent(MidiMessage::pitchWheel(channel, 8192 + (value - 64) * 32), 0); break;
+            case 1:  midi.addEvent(MidiMessage::channelPressureChange(channel, value), 0); break;
+            default: midi.addEvent(MidiMessage::controllerEvent(channel, 74, value), 0); break;
+            }
+        }
+    }
+};
+
+static NoteDispatchBenchmark noteDispatchBenchmark;
@@ -0,0 +1,187 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#include "BenchmarkUtilities.h"
+
+#if JUCE_LINUX
+ #include <linux/perf_event.h>
+ #include <sys/ioctl.h>
+ #include <sys/syscall.h>
+ #include <unistd.h>
+#endif
+
+//==============================================================================
+// Counts the cache misses on the calling thread, where the hardware and the
+// OS allow it. Only Linux is supported, and only if perf events are allowed
+// for the user (see /proc/sys/kernel/perf_event_paranoid).
+class CacheMissCounter final
+{
+public:
+    CacheMissCounter()
+    {
+       #if JUCE_LINUX
+        perf_event_attr attributes{};
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.size = sizeof(attributes);
+        attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+
+        fd = (int)syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+       #endif
+    }
+
+    ~CacheMissCounter()
+    {
+       #if JUCE_LINUX
+        if (fd >= 0)
+            close(fd);
+       #endif
+    }
+
+    bool isAvailable() const noexcept { return fd >= 0; }
+
+    void start() noexcept
+    {
+       #if JUCE_LINUX
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+       #endif
+    }
+
+    juce::uint64 stop() noexcept
+    {
+        juce::uint64 count = 0;
+
+       #if JUCE_LINUX
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+            if (read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count))
+                count = 0;
+        }
+       #endif
+
+        return count;
+    }
+
+private:
+    int fd = -1;
+
+    JUCE_DECLARE_NON_COPYABLE(CacheMissCounter)
+};
+
+//==============================================================================
+// Throughput and cache misses of the planar and interleaved sample layouts,
+// see SampleLayout.
+// Lots of instances each play their own sample, with every voice at a
+// different pitch, so the voices read from far more memory than the cache
+// holds, the way a big multi-sampled instrument would. Each round renders one
+// block on every instance, and throughput is in voice-frames per second.
+class SampleLayoutBenchmark final : public juce::UnitTest
+{
+public:
+    SampleLayoutBenchmark()
+        : juce::UnitTest("Sample layout", "Benchmarks")
+    {
+    }
+
+    void runTest() override
+    {
+        for (auto layout : { SampleLayout::planar, SampleLayout::interleaved })
+        {
+            const auto name = layout == SampleLayout::planar ? juce::String("Planar") : juce::String("Interleaved");
+            beginTest(name);
+
+            std::vector<std::unique_ptr<SamplerAudioProcessor>> processors;
+
+            for (auto i = 0; i < numInstances; ++i)
+            {
+                const auto frequency = 110.0f * std::pow(2.0f, (float)i / 12.0f);
+                processors.push_back(Benchmarks::makeProcessor(voicesPerInstance, Benchmarks::makeTestSample(2, sampleSeconds, frequency), layout));
+                Benchmarks::startNotes(*processors.back(), makeNotes(i));
+            }
+
+            juce::AudioBuffer<float> buffer(2, Benchmarks::blockSize);
+            MidiBuffer midi;
+            CacheMissCounter cacheMisses;
+            std::vector<double> times;
+            juce::uint64 totalMisses = 0;
+
+            for (auto round = 0; round < numWarmUpRounds + numRounds; ++round)
+            {
+                cacheMisses.start();
+                const auto start = juce::Time::getHighResolutionTicks();
+
+                for (auto& processor : processors)
+                    processor->processBlock(buffer, midi);
+
+                const auto end = juce::Time::getHighResolutionTicks();
+                const auto misses = cacheMisses.stop();
+
+                if (round < numWarmUpRounds)
+                    continue;
+
+                times.push_back(juce::Time::highResolutionTicksToSeconds(end - start));
+                totalMisses += misses;
+            }
+
+            std::nth_element(times.begin(), times.begin() + (std::ptrdiff_t)(times.size() / 2), times.end());
+            const auto voiceFramesPerRound = (double)numInstances * voicesPerInstance * Benchmarks::blockSize;
+
+            expect(times[times.size() / 2] > 0.0);
+            logMessage(juce::String::formatted("%s: %.1f M voice-frames per second", name.toRawUTF8(),
+                voiceFramesPerRound / times[times.size() / 2] / 1.0e6));
+
+            if (cacheMisses.isAvailable())
+                logMessage(juce::String::formatted("%s: %.2f cache misses per 1000 voice-frames", name.toRawUTF8(),
+                    (double)totalMisses * 1000.0 / (voiceFramesPerRound * numRounds)));
+            else
+                logMessage("Cache misses aren't available here. Try running this benchmark alone under perf stat -e cache-misses.");
+        }
+    }
+
+private:
+    enum
+    {
+        numInstances = 16,
+        voicesPerInstance = 32,
+        numWarmUpRounds = 20,
+        numRounds = 200
+    };
+
+    // Each instance holds 2 seconds of stereo, upsampled 8 times, which is
+    // around 6 MB.
+    static constexpr double sampleSeconds = 2.0;
+
+    // Every voice at a different pitch, so they all read at different speeds
+    // from different places.
+    static std::vector<std::pair<int, int>> makeNotes(int instance)
+    {
+        std::vector<std::pair<int, int>> notes;
+
+        for (auto i = 0; i < voicesPerInstance; ++i)
+            notes.push_back({ 2 + i % 15, 40 + (i + instance) % 48 });
+
+        return notes;
+    }
+};
+
+static SampleLayoutBenchmark sampleLayoutBenchmark;
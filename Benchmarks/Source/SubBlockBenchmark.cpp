@@ -0,0 +1,96 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#include "BenchmarkUtilities.h"
+
+//==============================================================================
+// What each MIDI event costs with different minimum sub-block sizes, see
+// SamplerAudioProcessor::setMinimumSubBlockSize().
+// Pitchbend messages are spread evenly across each block, so with no minimum
+// every one of them splits the render, and every split costs a round of
+// per-voice setup. The cost per event is the time of a block with events,
+// less the time of the same block without any.
+// The render quantum is turned off so that it doesn't split the blocks too.
+class SubBlockBenchmark final : public juce::UnitTest
+{
+public:
+    SubBlockBenchmark()
+        : juce::UnitTest("Sub-block size", "Benchmarks")
+    {
+    }
+
+    void runTest() override
+    {
+        for (auto keepNoteOnsExact : { false, true })
+        {
+            beginTest(keepNoteOnsExact ? "Note-ons kept exact" : "Every event on the grid");
+
+            for (auto minimumSize : { 1, 8, 32, 128 })
+            {
+                auto processor = Benchmarks::makeProcessor(numVoices);
+                processor->setRenderQuantum(0);
+                processor->setMinimumSubBlockSize(minimumSize, keepNoteOnsExact);
+                processor->prepareToPlay(Benchmarks::sampleRate, Benchmarks::blockSize);
+                Benchmarks::startNotes(*processor, makeNotes());
+
+                const auto withoutEvents = Benchmarks::timeBlocks(*processor, numBlocks, [](MidiBuffer&, int) {});
+
+                for (auto eventsPerBlock : { 16, 64, 256 })
+                {
+                    const auto withEvents = Benchmarks::timeBlocks(*processor, numBlocks, [eventsPerBlock](MidiBuffer& midi, int block)
+                        {
+                            addPitchbends(midi, block, eventsPerBlock);
+                        });
+
+                    const auto nanosPerEvent = jmax(0.0, withEvents - withoutEvents) * 1000.0 / eventsPerBlock;
+
+                    expect(withoutEvents > 0.0);
+                    logMessage(juce::String::formatted("minimum %3d samples, %3d events per block: %8.1f ns per event",
+                        minimumSize, eventsPerBlock, nanosPerEvent));
+                }
+            }
+        }
+    }
+
+private:
+    enum
+    {
+        numBlocks = 200,
+        numVoices = 32
+    };
+
+    // Spread over all 15 member channels.
+    static std::vector<std::pair<int, int>> makeNotes()
+    {
+        std::vector<std::pair<int, int>> notes;
+
+        for (auto i = 0; i < numVoices; ++i)
+            notes.push_back({ 2 + i % 15, 48 + i });
+
+        return notes;
+    }
+
+    static void addPitchbends(MidiBuffer& midi, int block, int eventsPerBlock)
+    {
+        for (auto i = 0; i < eventsPerBlock; ++i)
+        {
+            const auto channel = 2 + i % 15;
+            const auto value = 8192 + ((block + i) % 64 - 32) * 64;
+            midi.addEvent(MidiMessage::pitchWheel(channel, value), i * Benchmarks::blockSize / eventsPerBlock);
+        }
+    }
+};
+
+static SubBlockBenchmark subBlockBenchmark;
@@ -0,0 +1,315 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+enum class EnvelopeCurve
+{
+    linear,
+    exponential
+};
+
+struct EnvelopeParameters
+{
+    float attack = 0.1f;    // seconds
+    float decay = 0.1f;     // seconds
+    float sustain = 1.0f;
+    float release = 0.1f;   // seconds
+    EnvelopeCurve curve = EnvelopeCurve::linear;
+
+    bool operator== (const EnvelopeParameters& other) const noexcept
+    {
+        return attack == other.attack
+            && decay == other.decay
+            && sustain == other.sustain
+            && release == other.release
+            && curve == other.curve;
+    }
+
+    bool operator!= (const EnvelopeParameters& other) const noexcept { return !(*this == other); }
+};
+
+//==============================================================================
+// An ADSR envelope that produces a block of values at a time.
+// The linear curve behaves just like juce::ADSR. The exponential curve uses
+// the usual analogue-style segments which aim a little past their target, so
+// that they still arrive in the set time.
+// Whenever a segment starts, we work out exactly how many samples it will
+// last, so rendering a block is a handful of straight-line loops with no
+// per-sample state checks. Linear ramps are a multiply-add per sample, and
+// exponential ones are run as four interleaved lanes so that both vectorise.
+// advance() moves the envelope along without producing any output, which is
+// useful when nothing is listening to it.
+// Type is float or double, and everything is worked out at that precision.
+template <typename Type>
+class BlockEnvelope final
+{
+public:
+    using Parameters = EnvelopeParameters;
+
+    BlockEnvelope() = default;
+
+    void setSampleRate(double newSampleRate)
+    {
+        jassert(newSampleRate > 0.0);
+        sampleRate = newSampleRate;
+        startSegment();
+    }
+
+    // Cheap to call every block if nothing has changed.
+    void setParameters(const Parameters& newParameters)
+    {
+        if (newParameters == parameters)
+            return;
+
+        parameters = newParameters;
+        startSegment();
+    }
+
+    const Parameters& getParameters() const noexcept
+    {
+        return parameters;
+    }
+
+    void noteOn()
+    {
+        enterState(State::attack);
+    }
+
+    void noteOff()
+    {
+        if (state != State::idle)
+            enterState(State::release);
+    }
+
+    void reset()
+    {
+        level = 0;
+        enterState(State::idle);
+    }
+
+    bool isActive() const noexcept
+    {
+        return state != State::idle;
+    }
+
+    Type getLevel() const noexcept
+    {
+        return level;
+    }
+
+    // Writes the next numSamples values of the envelope into dest.
+    void render(Type* dest, int numSamples)
+    {
+        process(dest, numSamples);
+    }
+
+    // Moves the envelope on by numSamples without producing any output.
+    void advance(int numSamples)
+    {
+        process(nullptr, numSamples);
+    }
+
+private:
+    enum class State { idle, attack, decay, sustain, release };
+
+    // How far past the target the exponential segments aim. Larger values
+    // give straighter curves.
+    static constexpr Type attackOvershoot = (Type)0.3;
+    static constexpr Type decayOvershoot = (Type)0.0001;
+
+    void process(Type* dest, int numSamples)
+    {
+        while (numSamples > 0)
+        {
+            if (remaining <= 0)
+            {
+                // Idle and sustain just hold their level.
+                if (dest != nullptr)
+                    juce::FloatVectorOperations::fill(dest, level, numSamples);
+
+                return;
+            }
+
+            const auto n = jmin(numSamples, remaining);
+
+            if (parameters.curve == EnvelopeCurve::linear)
+                renderLinear(dest, n);
+            else
+                renderExponential(dest, n);
+
+            remaining -= n;
+            numSamples -= n;
+
+            // The last step of a segment lands exactly on its target.
+            if (remaining == 0)
+            {
+                level = target;
+
+                if (dest != nullptr)
+                    dest[n - 1] = target;
+
+                enterState(getNextState());
+            }
+
+            if (dest != nullptr)
+                dest += n;
+        }
+    }
+
+    void renderLinear(Type* dest, int n)
+    {
+        if (dest != nullptr)
+            for (auto i = 0; i < n; ++i)
+                dest[i] = level + increment * (Type)(i + 1);
+
+        level += increment * (Type)n;
+    }
+
+    void renderExponential(Type* dest, int n)
+    {
+        // level(i) = aim + (level - aim) * coefficient^(i + 1)
+        auto distance = level - aim;
+
+        if (dest != nullptr)
+        {
+            Type lanes[4];
+            auto power = coefficient;
+
+            for (auto& lane : lanes)
+            {
+                lane = distance * power;
+                power *= coefficient;
+            }
+
+            const auto step = coefficient * coefficient * coefficient * coefficient;
+            auto i = 0;
+
+            for (; i + 4 <= n; i += 4)
+            {
+                for (auto k = 0; k < 4; ++k)
+                {
+                    dest[i + k] = aim + lanes[k];
+                    lanes[k] *= step;
+                }
+            }
+
+            for (auto k = 0; i < n; ++i, ++k)
+                dest[i] = aim + lanes[k];
+        }
+
+        level = aim + distance * std::pow(coefficient, (Type)n);
+    }
+
+    State getNextState() const noexcept
+    {
+        switch (state)
+        {
+        case State::attack:  return State::decay;
+        case State::decay:   return State::sustain;
+        case State::release: return State::idle;
+        case State::idle:
+        case State::sustain:
+        default:             return state;
+        }
+    }
+
+    void enterState(State newState)
+    {
+        state = newState;
+        startSegment();
+    }
+
+    // Works out the current segment from the current level, so it copes with
+    // a segment starting part way, e.g. a release before the attack is done.
+    void startSegment()
+    {
+        remaining = 0;
+
+        switch (state)
+        {
+        case State::idle:
+            level = 0;
+            return;
+
+        case State::sustain:
+            level = parameters.sustain;
+            return;
+
+        case State::attack:
+            startRamp(1, parameters.attack, 1, attackOvershoot);
+            break;
+
+        case State::decay:
+            startRamp(parameters.sustain, parameters.decay, 1 - (Type)parameters.sustain, decayOvershoot);
+            break;
+
+        case State::release:
+            // Like juce::ADSR, a release takes the full release time from
+            // whatever level it starts at.
+            startRamp(0, parameters.release, level, decayOvershoot);
+            break;
+
+        default:
+            break;
+        }
+
+        // Nothing to do, e.g. a zero-length segment, or a decay with full
+        // sustain, so go straight on to the next one.
+        if (remaining <= 0)
+        {
+            level = target;
+            enterState(getNextState());
+        }
+    }
+
+    // Sets up a ramp from the current level to newTarget, where a ramp across
+    // 'span' takes 'seconds'.
+    void startRamp(Type newTarget, float seconds, Type span, Type overshoot)
+    {
+        target = newTarget;
+
+        const auto distance = target - level;
+        const auto fullLength = (double)seconds * sampleRate;
+
+        if (fullLength < 1.0 || span <= 0 || std::abs(distance) <= (Type)1.0e-7)
+            return;
+
+        if (parameters.curve == EnvelopeCurve::linear)
+        {
+            increment = (Type)(std::copysign((double)span, (double)distance) / fullLength);
+            remaining = jmax(1, (int)std::ceil(distance / increment));
+            return;
+        }
+
+        // Aim past the target by a fraction of the full span, with a rate
+        // chosen so that a full-span segment takes fullLength samples.
+        aim = target + std::copysign(overshoot * span, distance);
+        coefficient = (Type)std::exp(-std::log((1.0 + overshoot) / overshoot) / fullLength);
+        remaining = jmax(1, (int)std::ceil(std::log((target - aim) / (level - aim)) / std::log(coefficient)));
+    }
+
+    Parameters parameters;
+    double sampleRate = 44100.0;
+
+    State state = State::idle;
+    Type level = 0;
+    Type target = 0;
+    int remaining = 0;
+
+    Type increment = 0;     // linear
+    Type aim = 0;           // exponential
+    Type coefficient = 0;   // exponential
+};
@@ -39,12 +39,18 @@ public:
             });
     }
 
-    void call(Proc& proc) noexcept
+    // Runs every pending command, and returns how many were run.
+    int call(Proc& proc) noexcept
     {
+        auto numRun = 0;
+
         abstractFifo.read(abstractFifo.getNumReady()).forEach([&](int index)
             {
                 buffer[size_t(index)]->run(proc);
+                ++numRun;
             });
+
+        return numRun;
     }
 
 private:
@@ -0,0 +1,158 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+// How much corner-cutting the voices are allowed to do on notes that have
+// been released. Each level includes everything below it.
+enum class RenderQuality
+{
+    full,
+    tailsNearestSample,     // released voices read the nearest sample instead of interpolating
+    tailsFixedFilter,       // released voices stop updating the filter cutoff
+    tailsCulledEarly        // released voices stop as soon as they get quiet
+};
+
+//==============================================================================
+// Keeps an eye on how long each block takes to render compared with how long
+// it lasts in real time, and lowers the render quality a step at a time when
+// that gets too close for comfort.
+// The load is smoothed so that one slow block doesn't cause a change. Quality
+// drops as soon as the smoothed load goes over the high-water mark, but is
+// only restored after the load has stayed under the low-water mark for a
+// while, so it doesn't flip back and forth.
+// Audio thread only, apart from the counters.
+class CpuGovernor final
+{
+public:
+    struct Stats
+    {
+        RenderQuality quality = RenderQuality::full;
+        float load = 0.0f;
+        juce::uint32 numOverBudgetBlocks = 0;
+        juce::uint32 numDegrades = 0;
+        juce::uint32 numRestores = 0;
+
+        // Filled in by whoever owns the voices.
+        juce::uint32 numEarlyCulls = 0;
+    };
+
+    void prepare(double newSampleRate)
+    {
+        sampleRate = newSampleRate;
+        smoothedLoad = 0.0;
+        secondsUnderLowWater = 0.0;
+        setQuality(RenderQuality::full);
+    }
+
+    void setEnabled(bool shouldBeEnabled)
+    {
+        enabled = shouldBeEnabled;
+
+        if (!enabled)
+            setQuality(RenderQuality::full);
+    }
+
+    RenderQuality getQuality() const noexcept
+    {
+        return static_cast<RenderQuality> (quality.load(std::memory_order_relaxed));
+    }
+
+    // Call with the time taken to render numSamples samples, in high
+    // resolution ticks.
+    void blockRendered(juce::int64 elapsedTicks, int numSamples)
+    {
+        if (!enabled || numSamples <= 0 || sampleRate <= 0.0)
+            return;
+
+        const auto budget = numSamples / sampleRate;
+        const auto load = juce::Time::highResolutionTicksToSeconds(elapsedTicks) / budget;
+
+        smoothedLoad += (load - smoothedLoad) * smoothing;
+        currentLoad.store((float)smoothedLoad, std::memory_order_relaxed);
+
+        if (load > 1.0)
+            overBudgetBlocks.fetch_add(1, std::memory_order_relaxed);
+
+        const auto level = quality.load(std::memory_order_relaxed);
+
+        if (smoothedLoad > highWater)
+        {
+            secondsUnderLowWater = 0.0;
+
+            if (level < maxLevel)
+            {
+                setQuality(static_cast<RenderQuality> (level + 1));
+                degrades.fetch_add(1, std::memory_order_relaxed);
+
+                // Give the new level a chance to take effect before judging it.
+                smoothedLoad = lowWater;
+            }
+
+            return;
+        }
+
+        if (smoothedLoad < lowWater && level > 0)
+        {
+            secondsUnderLowWater += budget;
+
+            if (secondsUnderLowWater >= restoreHoldSeconds)
+            {
+                setQuality(static_cast<RenderQuality> (level - 1));
+                restores.fetch_add(1, std::memory_order_relaxed);
+                secondsUnderLowWater = 0.0;
+            }
+
+            return;
+        }
+
+        secondsUnderLowWater = 0.0;
+    }
+
+    // Safe to call from any thread.
+    Stats getStats() const noexcept
+    {
+        Stats stats;
+        stats.quality = getQuality();
+        stats.load = currentLoad.load(std::memory_order_relaxed);
+        stats.numOverBudgetBlocks = overBudgetBlocks.load(std::memory_order_relaxed);
+        stats.numDegrades = degrades.load(std::memory_order_relaxed);
+        stats.numRestores = restores.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    static constexpr double highWater = 0.75;
+    static constexpr double lowWater = 0.4;
+    static constexpr double smoothing = 0.1;
+    static constexpr double restoreHoldSeconds = 1.0;
+    static constexpr int maxLevel = (int)RenderQuality::tailsCulledEarly;
+
+    void setQuality(RenderQuality newQuality)
+    {
+        quality.store((int)newQuality, std::memory_order_relaxed);
+    }
+
+    bool enabled = true;
+    double sampleRate = 44100.0;
+    double smoothedLoad = 0.0;
+    double secondsUnderLowWater = 0.0;
+
+    std::atomic<int> quality{ 0 };
+    std::atomic<float> currentLoad{ 0.0f };
+    std::atomic<juce::uint32> overBudgetBlocks{ 0 };
+    std::atomic<juce::uint32> degrades{ 0 };
+    std::atomic<juce::uint32> restores{ 0 };
+};
@@ -24,17 +24,24 @@
 class MPESamplerSound final
 {
 public:
-    void setSample(std::unique_ptr<Sample> value)
+    // The previous sample is left to whoever else holds on to it, so swap it
+    // out with getSharedSample() first if it mustn't be freed here.
+    void setSample(std::shared_ptr<const Sample> value)
     {
         sample = std::move(value);
         setLoopPointsInSeconds(loopPoints);
     }
 
-    Sample* getSample() const
+    const Sample* getSample() const
     {
         return sample.get();
     }
 
+    std::shared_ptr<const Sample> getSharedSample() const
+    {
+        return sample;
+    }
+
     void setLoopPointsInSeconds(Range<double> value)
     {
         loopPoints = sample == nullptr ? value
@@ -68,7 +75,7 @@ public:
     }
 
 private:
-    std::unique_ptr<Sample> sample;
+    std::shared_ptr<const Sample> sample;
     double centreFrequencyInHz{ 440.0 };
     Range<double> loopPoints;
     LoopMode loopMode{ LoopMode::none };
@@ -16,6 +16,10 @@
 #pragma once
 
 #include "MPESamplerSound.h"
+#include "VoiceTelemetry.h"
+#include "CpuGovernor.h"
+#include "BlockEnvelope.h"
+#include "StateVariableFilter.h"
 
 class MPESamplerVoice final : public MPESynthesiserVoice
 {
@@ -26,7 +30,7 @@ public:
     {
         jassert(samplerSound != nullptr);
 
-        m_Buffer.setSize(2, 1, false, true, false);
+        forEachPrecision([](auto& p) { p.filter.setResonance(0.70710678118654752); });
     }
 
     void setCurrentSampleRate(double newRate) override {
@@ -37,13 +41,15 @@ public:
             return;
         }
 
-        ampEnv.setSampleRate(newRate);
-        filterEnv.setSampleRate(newRate);
+        forEachPrecision([newRate](auto& p)
+            {
+                p.ampEnv.setSampleRate(newRate);
+                p.filterEnv.setSampleRate(newRate);
+                p.filter.prepare(newRate);
+            });
 
-        int numChannels = 2;
-        int samplesPerBlock = 1;
-        juce::dsp::ProcessSpec spec{ newRate, static_cast<juce::uint32> (samplesPerBlock), static_cast<juce::uint32> (numChannels) };
-        m_Filter.prepare(spec); 
+        stealFadeLength = jmax(1, roundToInt(newRate * stealFadeLengthInSeconds));
+        updateSilenceHoldSamples();
     }
 
     void noteStarted() override
@@ -64,18 +70,38 @@ public:
 
         previousPressure = currentlyPlayingNote.pressure.asUnsignedFloat();
         currentSamplePos = 0.0;
+
+        // Keeps the sample's data in memory, or asks for it back, for as long
+        // as this note plays. A stolen voice lets go of the old note's hold
+        // only after taking the new one, so the data never goes in between.
+        auto* previousSample = std::exchange(playingSample, samplerSound->getSample());
+        playingSample->startedPlaying();
+
+        if (previousSample != nullptr)
+            previousSample->stoppedPlaying();
+
         tailOff = 0.0;
+        culledEarly = false;
+        culledAsSilent = false;
+        silentSamples = 0;
 
-        ampEnv.noteOn();
-        filterEnv.noteOn();
+        forEachPrecision([](auto& p)
+            {
+                p.ampEnv.noteOn();
+                p.filterEnv.noteOn();
+            });
     }
 
     void noteStopped(bool allowTailOff) override
     {
         jassert(currentlyPlayingNote.keyState == MPENote::off);
 
-        ampEnv.noteOff();
-        filterEnv.noteOff();
+        forEachPrecision([](auto& p)
+            {
+                p.ampReleaseLevel = p.ampEnv.getLevel();
+                p.ampEnv.noteOff();
+                p.filterEnv.noteOff();
+            });
 
         if (allowTailOff && juce::approximatelyEqual (tailOff, 0.0))
             tailOff = 1.0;
@@ -117,6 +143,120 @@ public:
         return currentSamplePos;
     }
 
+    // MPESynthesiser is a friend of MPESynthesiserVoice and updates the note
+    // directly. Subclasses of the synthesiser have to go through here.
+    void setCurrentlyPlayingNote(MPENote note)
+    {
+        currentlyPlayingNote = note;
+    }
+
+    // Called just before this voice is stolen for a new note. Rather than
+    // being cut off with a click, the old note keeps playing underneath the
+    // new one for a few milliseconds while it fades out. It carries on
+    // through its own copy of the filter, and wraps around the loop just as
+    // it would have done.
+    void beginStealFade()
+    {
+        if (!isActive())
+            return;
+
+        stealFade.position = currentSamplePos;
+        stealFade.increment = lastPitchRatio;
+        stealFade.direction = currentDirection;
+        stealFade.loopBegin = loopBeginRamp.value;
+        stealFade.loopEnd = loopEndRamp.value;
+        stealFade.canLoop = !isTailingOff();
+        stealFade.filtered = filterActive;
+        stealFade.gain = lastGain;
+        stealFade.gainStep = lastGain / (float)stealFadeLength;
+        stealFade.samplesRemaining = stealFadeLength;
+
+        forEachPrecision([](auto& p) { p.stealFadeFilter = p.filter; });
+    }
+
+    // The gain applied to the most recent output sample, before filtering.
+    float getCurrentGain() const noexcept
+    {
+        return lastGain;
+    }
+
+    // How much the voice may simplify its rendering once the note has been
+    // released. Set by the synthesiser before each render.
+    void setRenderQuality(RenderQuality newQuality) noexcept
+    {
+        renderQuality = newQuality;
+    }
+
+    // True if the voice last stopped because RenderQuality let it cut its
+    // release short.
+    bool wasCulledEarly() const noexcept
+    {
+        return culledEarly;
+    }
+
+    // A released note whose output stays below thresholdGain for holdSeconds
+    // is stopped, even if its envelope hasn't finished. A threshold or hold
+    // time of zero turns this off, and it's off to begin with.
+    void setSilenceDetection(float thresholdGain, double holdSeconds)
+    {
+        silenceThreshold = jmax(0.0f, thresholdGain);
+        silenceHoldSeconds = jmax(0.0, holdSeconds);
+        updateSilenceHoldSamples();
+    }
+
+    // True if the voice last stopped because its release had gone silent.
+    bool wasCulledAsSilent() const noexcept
+    {
+        return culledAsSilent;
+    }
+
+    // Silences the voice without any tail-off.
+    void stopImmediately()
+    {
+        if (isActive())
+            stopNote();
+    }
+
+    // Points the voice at a different sound and puts it back the way it was
+    // when it was constructed, apart from its sample rate and settings,
+    // without allocating anything. Any note is stopped immediately.
+    // The voice lets go of its old sound here, so the caller should hold on
+    // to that if it mustn't be freed on this thread.
+    void reset(std::shared_ptr<const MPESamplerSound> newSound)
+    {
+        jassert(newSound != nullptr);
+
+        stopImmediately();
+        samplerSound = std::move(newSound);
+
+        for (auto smoothed : { &level, &frequency, &loopBegin, &loopEnd })
+            smoothed->setCurrentAndTargetValue(0.0);
+
+        pitchRatioRamp = {};
+        loopBeginRamp = {};
+        loopEndRamp = {};
+        currentDirection = Direction::forward;
+        tailOff = 0.0;
+        lastPitchRatio = 1.0;
+        sampleLength = 0.0;
+        readStride = 1;
+        readFrames = 0;
+        stealFade = {};
+        silentSamples = 0;
+        culledEarly = false;
+        culledAsSilent = false;
+
+        publishTelemetry();
+    }
+
+    // The record that this voice reports its state to. The processor hands
+    // these out whenever the set of voices changes, on the audio thread.
+    void setTelemetry(VoiceTelemetry* newTelemetry)
+    {
+        telemetry = newTelemetry;
+        publishTelemetry();
+    }
+
     void sampleReaderChanged(std::shared_ptr<AudioFormatReaderFactory>) {}
     void centreFrequencyHzChanged(double) {}
     void loopModeChanged(LoopMode) {}
@@ -132,28 +272,38 @@ private:
 
     void updateAmpEnv() {
         
-        auto params = ampEnv.getParameters();
+        EnvelopeParameters params;
         params.attack = *valueTreeState.getRawParameterValue(IDs::ampEnvAttack) * .001;
         params.decay = *valueTreeState.getRawParameterValue(IDs::ampEnvDecay) * .001;
         params.sustain = *valueTreeState.getRawParameterValue(IDs::ampEnvSustain);
         params.release = *valueTreeState.getRawParameterValue(IDs::ampEnvRelease) *.001;
-        ampEnv.setParameters(params);
-        
-        // todo: update mod amount
+        params.curve = getCurve(IDs::ampEnvCurve);
+        forEachPrecision([&params](auto& p) { p.ampEnv.setParameters(params); });
+
+        ampEnvModAmt = *valueTreeState.getRawParameterValue(IDs::ampEnvModAmt);
+    }
+
+    EnvelopeCurve getCurve(const juce::Identifier& parameterID) const
+    {
+        return *valueTreeState.getRawParameterValue(parameterID) >= 0.5f ? EnvelopeCurve::exponential
+            : EnvelopeCurve::linear;
     }
 
     void updateFilter() {
         filterCutoff = *(valueTreeState.getRawParameterValue(IDs::filterCutoff));
+        const auto type = static_cast<FilterType> (roundToInt(valueTreeState.getRawParameterValue(IDs::filterType)->load()));
+        forEachPrecision([type](auto& p) { p.filter.setType(type); });
     }
 
     void updateFilterEnv() {
         
-        auto params = filterEnv.getParameters();
+        EnvelopeParameters params;
         params.attack = *valueTreeState.getRawParameterValue(IDs::filterEnvAttack) *.001;
         params.decay = *valueTreeState.getRawParameterValue(IDs::filterEnvDecay) *.001;
         params.sustain = *valueTreeState.getRawParameterValue(IDs::filterEnvSustain);
         params.release = *valueTreeState.getRawParameterValue(IDs::filterEnvRelease) *.001;
-        filterEnv.setParameters(params);
+        params.curve = getCurve(IDs::filterEnvCurve);
+        forEachPrecision([&params](auto& p) { p.filterEnv.setParameters(params); });
         
         filterCutoffModAmt = *valueTreeState.getRawParameterValue(IDs::filterEnvModAmt);
     }
@@ -170,10 +320,14 @@ private:
         loopBegin.setTargetValue(loopPoints.getStart() * samplerSound->getSample()->getSampleRate());
         loopEnd.setTargetValue(loopPoints.getEnd() * samplerSound->getSample()->getSampleRate());
 
-        auto& data = samplerSound->getSample()->getBuffer();
+        // If the bulk of the sample is on disk, play from as much of it as
+        // has been read back in so far.
+        auto* sample = samplerSound->getSample();
+        auto& data = sample->getPlayableData(readFrames);
 
-        auto inL = data.getReadPointer(0);
-        auto inR = data.getNumChannels() > 1 ? data.getReadPointer(1) : nullptr;
+        auto inL = data.getChannel(0);
+        auto inR = data.getNumChannels() > 1 ? data.getChannel(1) : nullptr;
+        readStride = data.getStride();
 
         auto outL = outputBuffer.getWritePointer(0, startSample);
 
@@ -183,84 +337,504 @@ private:
         auto outR = outputBuffer.getNumChannels() > 1 ? outputBuffer.getWritePointer(1, startSample)
             : nullptr;
 
+        // These can't change part way through, because notes only start and
+        // stop between calls to render.
+        ampActive = *valueTreeState.getRawParameterValue(IDs::ampActive);
+        filterActive = *valueTreeState.getRawParameterValue(IDs::filterActive);
+
+        const auto quality = isTailingOff() ? renderQuality : RenderQuality::full;
+        const auto needsFilterEnv = filterActive && quality < RenderQuality::tailsFixedFilter;
+        const auto* hostRateCopy = samplerSound->getSample()->getHostRateCopy(this->currentSampleRate);
+        auto& p = std::get<Processing<Element>>(processing);
+
         size_t writePos = 0;
 
-        while (--numSamples >= 0 && renderNextSample(inL, inR, outL, outR, writePos))
-            writePos += 1;
+        // The envelopes are worked out a block at a time, and the filter
+        // envelope is only rendered if something is going to use it.
+        while (numSamples > 0)
+        {
+            const auto blockSize = jmin(numSamples, (int)envelopeBlockSize, getNumSamplesUntilSettled());
+
+            prepareRamps(blockSize);
+            prefetchNextBlock(data, blockSize);
+            p.ampEnv.render(p.ampEnvBlock.data(), blockSize);
+
+            if (needsFilterEnv)
+                p.filterEnv.render(p.filterEnvBlock.data(), blockSize);
+            else
+                p.filterEnv.advance(blockSize);
+
+            int hostRateSpeed;
+            juce::int64 hostRatePos;
+
+            if (canCopyAtHostRate(hostRateCopy, hostRateSpeed, hostRatePos))
+            {
+                if (!copyAtHostRate(*hostRateCopy, hostRateSpeed, hostRatePos, outL, outR, writePos, blockSize))
+                {
+                    publishTelemetry();
+                    return;
+                }
+
+                writePos += (size_t)blockSize;
+            }
+            else if (readFrames < sample->getNumFrames() && !isWithinReadyFrames(blockSize))
+            {
+                sample->streamUnderrun();
+
+                if (!skipSamples(blockSize))
+                {
+                    publishTelemetry();
+                    return;
+                }
+
+                writePos += (size_t)blockSize;
+            }
+            else
+            {
+                const auto keepGoing = inR != nullptr ? renderSamples<true>(inL, inR, outL, outR, writePos, blockSize)
+                    : renderSamples<false>(inL, inR, outL, outR, writePos, blockSize);
+
+                if (!keepGoing)
+                {
+                    publishTelemetry();
+                    return;
+                }
+
+                writePos += (size_t)blockSize;
+            }
+
+            numSamples -= blockSize;
+        }
+
+        publishTelemetry();
+    }
+
+    void publishTelemetry()
+    {
+        if (telemetry == nullptr)
+            return;
+
+        VoiceTelemetry::Snapshot snapshot;
+        snapshot.active = isActive();
+
+        if (snapshot.active)
+        {
+            snapshot.noteNumber = currentlyPlayingNote.initialNote;
+            snapshot.envelopeLevel = ampEnvLevel;
+
+            if (auto* sample = samplerSound->getSample())
+                snapshot.positionSeconds = static_cast<float> (currentSamplePos / sample->getSampleRate());
+        }
+
+        telemetry->publish(snapshot);
+    }
+
+    // A value that changes by a fixed step every sample.
+    struct Ramp
+    {
+        double value = 0.0;
+        double step = 0.0;
+
+        double next() noexcept
+        {
+            value += step;
+            return value;
+        }
+    };
+
+    // A SmoothedValue that can tell how long it has left to go.
+    struct Smoother : SmoothedValue<double>
+    {
+        using SmoothedValue<double>::SmoothedValue;
+
+        int getNumStepsLeft() const noexcept { return this->countdown; }
+    };
+
+    // How many samples until the first of the moving smoothers settles.
+    // Blocks are split there, so that no ramp ever spans the point where a
+    // smoother stops moving.
+    int getNumSamplesUntilSettled() const noexcept
+    {
+        auto numSamples = std::numeric_limits<int>::max();
+
+        for (auto* smoothed : { &frequency, &loopBegin, &loopEnd })
+            if (smoothed->isSmoothing())
+                numSamples = jmin(numSamples, smoothed->getNumStepsLeft());
+
+        return jmax(1, numSamples);
+    }
+
+    // Works out the pitch ratio and loop bounds for the next numSamples
+    // samples in one go. Blocks never run past the point where a smoother
+    // settles, so while one is moving, its linear ramp over the block is
+    // followed sample for sample (up to rounding) by a start value and a
+    // step. Once it has settled, the step is zero and nothing needs updating
+    // per sample.
+    void prepareRamps(int numSamples)
+    {
+        auto* sample = samplerSound->getSample();
+        sampleLength = (double)sample->getLength();
+
+        const auto pitchRatioScale = sample->getSampleRate() / (samplerSound->getCentreFrequencyInHz() * this->currentSampleRate);
+
+        auto makeRamp = [numSamples](Smoother& smoothed, double scale)
+        {
+            Ramp ramp;
+            ramp.value = smoothed.getCurrentValue() * scale;
+
+            if (smoothed.isSmoothing())
+                ramp.step = (smoothed.skip(numSamples) * scale - ramp.value) / numSamples;
+
+            return ramp;
+        };
+
+        pitchRatioRamp = makeRamp(frequency, pitchRatioScale);
+        loopBeginRamp = makeRamp(loopBegin, 1.0);
+        loopEndRamp = makeRamp(loopEnd, 1.0);
+    }
+
+    // Asks for the sample data the block after this one will read to be
+    // fetched while this one renders. If a forward loop is about to wrap,
+    // the start of the loop is fetched too, since the read head is going to
+    // jump back there.
+    void prefetchNextBlock(const SampleData& data, int numSamples) const noexcept
+    {
+        const auto maxRatio = jmax(std::abs(pitchRatioRamp.value),
+            std::abs(pitchRatioRamp.value + pitchRatioRamp.step * numSamples));
+        const auto span = (int)(maxRatio * numSamples) + 2;
+        const auto pos = (int)currentSamplePos;
+
+        if (currentDirection == Direction::forward)
+            data.prefetch(pos + span, span);
+        else
+            data.prefetch(pos - 2 * span, span);
+
+        if (samplerSound->getLoopMode() == LoopMode::forward
+            && currentDirection == Direction::forward
+            && !isTailingOff()
+            && pos + 2 * span > (int)loopEndRamp.value)
+            data.prefetch((int)loopBeginRamp.value, span);
+    }
+
+    // True if everything the next numSamples samples read is in memory.
+    bool isWithinReadyFrames(int numSamples) const noexcept
+    {
+        const auto maxRatio = jmax(std::abs(pitchRatioRamp.value),
+            std::abs(pitchRatioRamp.value + pitchRatioRamp.step * numSamples));
+
+        return currentSamplePos + maxRatio * numSamples + 2.0 < (double)readFrames;
+    }
+
+    // Moves the note along without producing anything, for when the data it
+    // needs isn't in memory yet.
+    bool skipSamples(int numSamples)
+    {
+        for (auto i = 0; i < numSamples; ++i)
+        {
+            lastPitchRatio = pitchRatioRamp.next();
+            const auto currentLoopBegin = loopBeginRamp.next();
+            const auto currentLoopEnd = loopEndRamp.next();
+
+            std::tie(currentSamplePos, currentDirection) = getNextState(lastPitchRatio,
+                currentLoopBegin,
+                currentLoopEnd);
+
+            if (currentSamplePos > sampleLength)
+            {
+                stopNote();
+                return false;
+            }
+        }
+
+        stealFade.samplesRemaining = 0;
+        return true;
+    }
+
+    // True if the next block can be copied straight out of the host-rate
+    // copy of the sample. That needs a steady pitch of a whole-number multiple
+    // of the centre frequency, a position that falls exactly on a host-rate
+    // sample, and nothing going on that needs the per-sample path: a loop, the
+    // filter, a release, or the fade of a stolen note.
+    bool canCopyAtHostRate(const Sample::HostRateCopy* copy, int& speed, juce::int64& position) const
+    {
+        if (copy == nullptr
+            || pitchRatioRamp.step != 0.0
+            || samplerSound->getLoopMode() != LoopMode::none
+            || currentDirection != Direction::forward
+            || filterActive
+            || isTailingOff()
+            || stealFade.samplesRemaining > 0)
+            return false;
+
+        // Pitch is within a fiftieth of a cent of a whole-number multiple.
+        const auto exactSpeed = frequency.getCurrentValue() / samplerSound->getCentreFrequencyInHz();
+        speed = roundToInt(exactSpeed);
+
+        if (speed < 1 || std::abs(exactSpeed - speed) > 1.0e-5 * speed)
+            return false;
+
+        const auto exactPosition = currentSamplePos / getHostRateStep();
+        position = (juce::int64)std::llround(exactPosition);
+
+        return std::abs(exactPosition - (double)position) < 1.0e-6;
     }
 
+    // The distance between host-rate samples, in the upsampled sample data.
+    double getHostRateStep() const
+    {
+        return samplerSound->getSample()->getSampleRate() / this->currentSampleRate;
+    }
+
+    // The whole per-sample path boils down to a copy with a gain here.
     template <typename Element>
+    bool copyAtHostRate(const Sample::HostRateCopy& copy,
+        int speed,
+        juce::int64 position,
+        Element* outL,
+        Element* outR,
+        size_t writePos,
+        int numSamples)
+    {
+        const auto* inL = copy.data.getChannel(0);
+        const auto* inR = copy.data.getNumChannels() > 1 ? copy.data.getChannel(1) : nullptr;
+        const auto stride = (juce::int64)copy.data.getStride();
+        const auto& ampEnvBlock = std::get<Processing<Element>>(processing).ampEnvBlock;
+        const auto velocity = (Element)currentlyPlayingNote.noteOnVelocity.asUnsignedFloat();
+        auto stopped = false;
+
+        for (auto i = 0; i < numSamples; ++i, position += speed)
+        {
+            if (position >= copy.length)
+            {
+                stopped = true;
+                break;
+            }
+
+            auto gain = velocity;
+
+            if (ampActive)
+                gain *= getAmpGain(ampEnvBlock[(size_t)i]);
+
+            ampEnvLevel = (float)ampEnvBlock[(size_t)i];
+            lastGain = (float)gain;
+
+            const auto l = (Element)inL[position * stride] * gain;
+            const auto r = inR != nullptr ? (Element)inR[position * stride] * gain : l;
+
+            if (outR != nullptr)
+            {
+                outL[writePos + (size_t)i] += l;
+                outR[writePos + (size_t)i] += r;
+            }
+            else
+            {
+                outL[writePos + (size_t)i] += (l + r) * 0.5f;
+            }
+        }
+
+        lastPitchRatio = pitchRatioRamp.value;
+        currentSamplePos = (double)position * getHostRateStep();
+
+        if (stopped)
+            stopNote();
+
+        return !stopped;
+    }
+
+    // Advances the fading-out note of a stolen voice by one sample. Its output
+    // is added in along with the new note's, so that every voice adds to each
+    // output sample exactly once.
+    template <typename Element>
+    void nextStealFadeSample(const float* inL, const float* inR, Element& l, Element& r)
+    {
+        auto& fade = stealFade;
+        auto pos = (int)fade.position;
+
+        if (pos < 0 || pos + 1 >= readFrames)
+        {
+            fade.samplesRemaining = 0;
+            return;
+        }
+
+        const auto index = (size_t)pos * (size_t)readStride;
+        const auto next = index + (size_t)readStride;
+        auto alpha = (Element)(fade.position - pos);
+        l = ((Element)inL[index] + ((Element)inL[next] - (Element)inL[index]) * alpha) * (Element)fade.gain;
+
+        if (inR != nullptr)
+            r = ((Element)inR[index] + ((Element)inR[next] - (Element)inR[index]) * alpha) * (Element)fade.gain;
+
+        // The gain is applied before the filter, just like the voice does.
+        if (fade.filtered)
+        {
+            auto& filter = std::get<Processing<Element>>(processing).stealFadeFilter;
+
+            if (inR != nullptr)
+                filter.process(l, r);
+            else
+                filter.processMono(l);
+        }
+
+        if (inR == nullptr)
+            r = l;
+
+        std::tie(fade.position, fade.direction) = getNextState(fade.position, fade.direction, fade.increment,
+            fade.loopBegin, fade.loopEnd, fade.canLoop);
+        fade.gain -= fade.gainStep;
+        --fade.samplesRemaining;
+    }
+
+    // Runs the per-sample path over one envelope block. A mono sample is
+    // interpolated and filtered once, and the result goes to both outputs.
+    template <bool isStereo, typename Element>
+    bool renderSamples(const float* inL,
+        const float* inR,
+        Element* outL,
+        Element* outR,
+        size_t writePos,
+        int numSamples)
+    {
+        for (auto i = 0; i < numSamples; ++i)
+            if (!renderNextSample<isStereo>(inL, inR, outL, outR, writePos + (size_t)i, i))
+                return false;
+
+        return true;
+    }
+
+    template <bool isStereo, typename Element>
     bool renderNextSample(const float* inL,
         const float* inR,
         Element* outL,
         Element* outR,
-        size_t writePos)
+        size_t writePos,
+        int envelopeIndex)
     {
-        auto currentFrequency = frequency.getNextValue();  // based on note pitch
-        auto currentLoopBegin = loopBegin.getNextValue();
-        auto currentLoopEnd = loopEnd.getNextValue();
+        auto currentPitchRatio = pitchRatioRamp.next();  // based on note pitch
+        auto currentLoopBegin = loopBeginRamp.next();
+        auto currentLoopEnd = loopEndRamp.next();
+
+        auto& p = std::get<Processing<Element>>(processing);
 
-        bool ampActive = *valueTreeState.getRawParameterValue(IDs::ampActive);
-        float ampEnvLast = ampEnv.getNextSample();
+        // The envelope, gain and filter all work at the host's precision.
+        // Only the sample data itself is stored as float.
+        const auto ampEnvLast = p.ampEnvBlock[(size_t)envelopeIndex];
+        ampEnvLevel = (float)ampEnvLast;
 
+        // Only released notes are ever rendered at reduced quality.
+        const auto quality = isTailingOff() ? renderQuality : RenderQuality::full;
+
+        const auto ampGain = ampActive ? getAmpGain(ampEnvLast) : (Element)1;
+
+        // What's heard is the gain after the depth is applied, so that's what
+        // decides when a release is over.
         if (ampActive && isTailingOff())
         {
-            if (ampEnvLast < 0.001)
+            // Whatever the depth, a finished release is silent.
+            jassert(ampEnvLast > 0 || ampGain == 0);
+
+            const auto threshold = quality >= RenderQuality::tailsCulledEarly ? 0.01f : 0.001f;
+
+            if (ampGain < (Element)threshold)
             {
+                culledEarly = ampGain >= (Element)0.001;
                 stopNote();
                 return false;
             }
         }
 
         auto pos = (int)currentSamplePos;
-        auto nextPos = pos + 1;
-        auto alpha = (Element)(currentSamplePos - pos);
-        auto invAlpha = 1.0f - alpha;
+        const auto index = (size_t)pos * (size_t)readStride;
+        Element l, r = 0;
 
-        // Very simple linear interpolation here because the Sampler class should have already upsampled.
-        auto l = static_cast<Element> ((inL[pos] * invAlpha + inL[nextPos] * alpha));
-        auto r = static_cast<Element> ((inR != nullptr) ? (inR[pos] * invAlpha + inR[nextPos] * alpha)
-            : l);
+        if (quality >= RenderQuality::tailsNearestSample)
+        {
+            l = static_cast<Element> (inL[index]);
 
-        m_Buffer.setSample(0, 0, l);
-        m_Buffer.setSample(1, 0, r);
+            if constexpr (isStereo)
+                r = static_cast<Element> (inR[index]);
+        }
+        else
+        {
+            auto nextIndex = index + (size_t)readStride;
+            auto alpha = (Element)(currentSamplePos - pos);
+            auto invAlpha = 1 - alpha;
+
+            // Very simple linear interpolation here because the Sampler class should have already upsampled.
+            l = inL[index] * invAlpha + inL[nextIndex] * alpha;
+
+            if constexpr (isStereo)
+                r = inR[index] * invAlpha + inR[nextIndex] * alpha;
+        }
 
         // apply velocity-> gain
-        m_Buffer.applyGain(currentlyPlayingNote.noteOnVelocity.asUnsignedFloat());
+        auto gain = (Element)currentlyPlayingNote.noteOnVelocity.asUnsignedFloat();
 
         // apply amplitude
-        if (ampActive) {
-            m_Buffer.applyGain(ampEnvLast);
-        }
+        if (ampActive)
+            gain *= ampGain;
+
+        lastGain = (float)gain;
 
-        float cutoff = filterCutoff + filterCutoffModAmt*filterEnv.getNextSample();
-        cutoff = fmax(40., fmin(20000., cutoff));
+        auto voiceL = l * gain;
+        auto voiceR = r * gain;
 
-        float q_val = 0.70710678118;
-        *m_Filter.state = *juce::dsp::IIR::Coefficients<float>::makeLowPass(currentSampleRate, cutoff, q_val);
+        if (filterActive) {
+            // A released voice at reduced quality keeps whatever cutoff it had.
+            // Otherwise the cutoff follows the envelope every sample, which
+            // the SVF handles without redesigning anything.
+            if (quality < RenderQuality::tailsFixedFilter)
+            {
+                auto cutoff = (Element)filterCutoff + (Element)filterCutoffModAmt * p.filterEnvBlock[(size_t)envelopeIndex];
+                p.filter.setCutoff(juce::jlimit((Element)40, (Element)20000, cutoff));
+            }
 
-        if (*valueTreeState.getRawParameterValue(IDs::filterActive)) {
-            // apply low pass filter
-            juce::dsp::AudioBlock<float> block(m_Buffer);
-            juce::dsp::ProcessContextReplacing<float> context(block);
-            m_Filter.process(context);
+            if constexpr (isStereo)
+                p.filter.process(voiceL, voiceR);
+            else
+                p.filter.processMono(voiceL);
         }
 
+        if constexpr (!isStereo)
+            voiceR = voiceL;
+
+        auto fadeL = (Element)0, fadeR = (Element)0;
+
+        if (stealFade.samplesRemaining > 0)
+            nextStealFadeSample(inL, inR, fadeL, fadeR);
+
         if (outR != nullptr)
         {
-            outL[writePos] += m_Buffer.getSample(0, 0);
-            outR[writePos] += m_Buffer.getSample(1, 0);
+            outL[writePos] += voiceL + fadeL;
+            outR[writePos] += voiceR + fadeR;
         }
         else
         {
-            outL[writePos] += (m_Buffer.getSample(0, 0) + m_Buffer.getSample(1, 0)) * 0.5f;
+            outL[writePos] += (voiceL + fadeL + voiceR + fadeR) * (Element)0.5;
+        }
+
+        // This looks at what actually came out, after the envelope and filter,
+        // so it also catches tails that never end, e.g. a looping voice with
+        // the amp envelope switched off.
+        if (silenceHoldSamples > 0 && isTailingOff())
+        {
+            const auto peak = jmax(std::abs(voiceL + fadeL), std::abs(voiceR + fadeR));
+            silentSamples = peak < (Element)silenceThreshold ? silentSamples + 1 : 0;
+
+            if (silentSamples >= silenceHoldSamples)
+            {
+                culledAsSilent = true;
+                stopNote();
+                return false;
+            }
         }
 
-        std::tie(currentSamplePos, currentDirection) = getNextState(currentFrequency,
+        lastPitchRatio = currentPitchRatio;
+
+        std::tie(currentSamplePos, currentDirection) = getNextState(lastPitchRatio,
             currentLoopBegin,
             currentLoopEnd);
 
-        if (currentSamplePos > samplerSound->getSample()->getLength())
+        if (currentSamplePos > sampleLength)
         {
             stopNote();
             return false;
@@ -269,6 +843,25 @@ private:
         return true;
     }
 
+    // The gain from the amp envelope, given its current value.
+    // ampEnvModAmt is the depth of the envelope: 0 ignores it, 1 follows it
+    // exactly, and higher values exaggerate it. Below a depth of 1 the
+    // envelope on its own never takes the gain to zero, so once the note is
+    // released, the gain it had at that moment fades out in step with the
+    // release instead.
+    template <typename Element>
+    Element getAmpGain(Element ampEnv) const noexcept
+    {
+        const auto depth = (Element)ampEnvModAmt;
+        auto applyDepth = [depth](Element level) { return jmax((Element)0, 1 + depth * (level - 1)); };
+
+        if (!isTailingOff() || depth >= 1)
+            return applyDepth(ampEnv);
+
+        const auto releaseLevel = std::get<Processing<Element>>(processing).ampReleaseLevel;
+        return releaseLevel > 0 ? applyDepth(releaseLevel) * ampEnv / releaseLevel : (Element)0;
+    }
+
     double getSampleValue() const;
 
     bool isTailingOff() const
@@ -279,18 +872,23 @@ private:
     void stopNote()
     {
 
-        // todo: are these necessary?
-        if (ampEnv.isActive()) {
-            ampEnv.reset();
-        }
-        if (filterEnv.isActive()) {
-            filterEnv.reset();
-        }
-
-        m_Filter.reset();
+        forEachPrecision([](auto& p)
+            {
+                p.ampEnv.reset();
+                p.filterEnv.reset();
+                p.filter.reset();
+            });
 
         clearCurrentNote();
         currentSamplePos = 0.0;
+        ampEnvLevel = 0.0f;
+        lastGain = 0.0f;
+        stealFade.samplesRemaining = 0;
+
+        if (playingSample != nullptr)
+            std::exchange(playingSample, nullptr)->stoppedPlaying();
+
+        publishTelemetry();
     }
 
     enum class Direction
@@ -299,17 +897,27 @@ private:
         backward
     };
 
-    std::tuple<double, Direction> getNextState(double freq,
+    std::tuple<double, Direction> getNextState(double nextPitchRatio,
         double begin,
         double end) const
     {
-        auto nextPitchRatio = (freq / samplerSound->getCentreFrequencyInHz()) * samplerSound->getSample()->getSampleRate() / this->currentSampleRate;
+        return getNextState(currentSamplePos, currentDirection, nextPitchRatio, begin, end, !isTailingOff());
+    }
 
-        auto nextSamplePos = currentSamplePos;
-        auto nextDirection = currentDirection;
+    // Where a read head at samplePos, moving in direction, goes next. It only
+    // wraps around the loop if canLoop is set, i.e. the note isn't released.
+    std::tuple<double, Direction> getNextState(double samplePos,
+        Direction direction,
+        double nextPitchRatio,
+        double begin,
+        double end,
+        bool canLoop) const
+    {
+        auto nextSamplePos = samplePos;
+        auto nextDirection = direction;
 
         // Move the current sample pos in the correct direction
-        switch (currentDirection)
+        switch (direction)
         {
         case Direction::forward:
             nextSamplePos += nextPitchRatio;
@@ -337,7 +945,7 @@ private:
         if (samplerSound->getLoopMode() == LoopMode::none)
             return std::tuple<double, Direction>(nextSamplePos, nextDirection);
 
-        if (nextDirection == Direction::forward && end < nextSamplePos && !isTailingOff())
+        if (nextDirection == Direction::forward && end < nextSamplePos && canLoop)
         {
             if (samplerSound->getLoopMode() == LoopMode::forward)
                 nextSamplePos = begin;
@@ -353,22 +961,93 @@ private:
     AudioProcessorValueTreeState& valueTreeState;  // from the SamplerAudioProcessor
 
     std::shared_ptr<const MPESamplerSound> samplerSound;
-    SmoothedValue<double> level { 0 };
-    SmoothedValue<double> frequency{ 0 };
-    SmoothedValue<double> loopBegin;
-    SmoothedValue<double> loopEnd;
+    Smoother level { 0 };
+    Smoother frequency{ 0 };
+    Smoother loopBegin;
+    Smoother loopEnd;
     double previousPressure { 0 };
     double currentSamplePos{ 0 };
     double tailOff{ 0 };
     Direction currentDirection{ Direction::forward };
     double smoothingLengthInSeconds{ 0.01 };
+    double lastPitchRatio{ 1.0 };
+    double sampleLength{ 0.0 };
+    int readStride{ 1 };    // the distance between frames in the sample data
+    int readFrames{ 0 };    // how many frames of it are ready to read
+    const Sample* playingSample = nullptr;
+    Ramp pitchRatioRamp, loopBeginRamp, loopEndRamp;
+    float lastGain{ 0.0f };
+
+    struct StealFade
+    {
+        double position = 0.0;
+        double increment = 0.0;
+        Direction direction = Direction::forward;
+        double loopBegin = 0.0;
+        double loopEnd = 0.0;
+        bool canLoop = false;
+        bool filtered = false;
+        float gain = 0.0f;
+        float gainStep = 0.0f;
+        int samplesRemaining = 0;
+    };
+
+    StealFade stealFade;
+    double stealFadeLengthInSeconds{ 0.005 };
+    int stealFadeLength{ 1 };
+
+    RenderQuality renderQuality{ RenderQuality::full };
+    bool culledEarly = false;
+
+    void updateSilenceHoldSamples()
+    {
+        silenceHoldSamples = silenceThreshold > 0.0f && silenceHoldSeconds > 0.0 && currentSampleRate > 0.0
+            ? jmax(1, roundToInt(currentSampleRate * silenceHoldSeconds))
+            : 0;
+    }
+
+    float silenceThreshold{ 0.0001f };   // -80 dB
+    double silenceHoldSeconds{ 0.0 };    // off until setSilenceDetection() turns it on
+    int silenceHoldSamples{ 0 };
+    int silentSamples{ 0 };
+    bool culledAsSilent = false;
+
+    enum { envelopeBlockSize = 64 };
+
+    // The envelopes and filter, at one precision. The voice keeps a set for
+    // float and one for double, and renders with whichever matches the
+    // buffer it's given, so a double-precision host gets double all the way
+    // through. Notes start and stop on both sets, but only the one in use
+    // is advanced, since hosts only change precision between prepareToPlay
+    // calls.
+    template <typename Type>
+    struct Processing
+    {
+        BlockEnvelope<Type> ampEnv;
+        BlockEnvelope<Type> filterEnv;
+        StereoStateVariableFilter<Type> filter;
+        StereoStateVariableFilter<Type> stealFadeFilter;   // the filter as it was when the voice was stolen
+        std::array<Type, envelopeBlockSize> ampEnvBlock{};
+        std::array<Type, envelopeBlockSize> filterEnvBlock{};
+        Type ampReleaseLevel = 0;   // the amp envelope when the note was released
+    };
+
+    std::tuple<Processing<float>, Processing<double>> processing;
+
+    template <typename Fn>
+    void forEachPrecision(Fn&& fn)
+    {
+        fn(std::get<Processing<float>>(processing));
+        fn(std::get<Processing<double>>(processing));
+    }
 
-    ADSR ampEnv;
+    float ampEnvLevel = 0.0f;
+    float ampEnvModAmt = 1.0f;
+    bool ampActive = false;
 
-    ADSR filterEnv;
+    bool filterActive = false;
     double filterCutoff = 20000.;
     double filterCutoffModAmt = 0.;
 
-    juce::dsp::ProcessorDuplicator<juce::dsp::IIR::Filter<float>, juce::dsp::IIR::Coefficients<float>> m_Filter;
-    juce::AudioBuffer<float> m_Buffer;
+    VoiceTelemetry* telemetry = nullptr;
 };
@@ -0,0 +1,196 @@
+/*
+  ==============================================================================
+
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+//==============================================================================
+// Thins out dense MPE controller streams before they reach the synthesiser.
+// Every pitchbend, channel pressure or timbre (CC 74) message makes
+// MPESynthesiser split the render and call back into the voices, and an
+// expressive controller can send one of each per finger per millisecond.
+// The block is divided into fixed windows, and within each window only the
+// last message of each kind on each channel is kept, at its own timestamp.
+// Anything else on a channel (note on and off in particular) flushes that
+// channel's pending messages first, so per-channel ordering is preserved and
+// notes stay sample-accurate.
+// A window of zero disables the pass. Audio thread only, apart from the
+// counter.
+class MidiCoalescer final
+{
+public:
+    MidiCoalescer()
+    {
+        scratch.ensureSize(initialScratchBytes);
+    }
+
+    void prepare(double newSampleRate)
+    {
+        sampleRate = newSampleRate;
+        updateWindowLength();
+    }
+
+    void setWindowLength(double seconds)
+    {
+        windowSeconds = jmax(0.0, seconds);
+        updateWindowLength();
+    }
+
+    double getWindowLength() const noexcept
+    {
+        return windowSeconds;
+    }
+
+    bool isEnabled() const noexcept
+    {
+        return windowSamples > 0;
+    }
+
+    void process(MidiBuffer& midi)
+    {
+        if (!isEnabled() || midi.getNumEvents() < 2)
+            return;
+
+        // The output can never be larger than the input, so after this
+        // nothing below allocates.
+        scratch.clear();
+        scratch.ensureSize((size_t)midi.data.size());
+
+        auto currentWindow = 0;
+        auto numMerged = 0u;
+
+        for (const auto metadata : midi)
+        {
+            const auto window = metadata.samplePosition / windowSamples;
+
+            if (window != currentWindow)
+            {
+                flushAll();
+                currentWindow = window;
+            }
+
+            if (auto* slot = findSlot(metadata.data, metadata.numBytes))
+            {
+                if (slot->pending)
+                    ++numMerged;
+
+                slot->pending = true;
+                slot->numBytes = metadata.numBytes;
+                slot->samplePosition = metadata.samplePosition;
+                std::copy(metadata.data, metadata.data + metadata.numBytes, slot->bytes.begin());
+                continue;
+            }
+
+            if (isChannelMessage(metadata.data, metadata.numBytes))
+                flushChannel(metadata.data[0] & 0x0f);
+            else
+                flushAll();
+
+            scratch.addEvent(metadata.data, metadata.numBytes, metadata.samplePosition);
+        }
+
+        flushAll();
+        midi.swapWith(scratch);
+
+        if (numMerged != 0)
+            mergedMessages.fetch_add(numMerged, std::memory_order_relaxed);
+    }
+
+    // How many controller messages have been dropped in favour of a later
+    // one. Safe to call from any thread.
+    juce::uint32 getNumMergedMessages() const noexcept
+    {
+        return mergedMessages.load(std::memory_order_relaxed);
+    }
+
+private:
+    enum Kind { pitchbend, pressure, timbre, numKinds };
+    enum { numChannels = 16, initialScratchBytes = 4096 };
+
+    struct Slot
+    {
+        bool pending = false;
+        int numBytes = 0;
+        int samplePosition = 0;
+        std::array<juce::uint8, 3> bytes{};
+    };
+
+    static bool isChannelMessage(const juce::uint8* data, int numBytes) noexcept
+    {
+        return numBytes > 0 && data[0] >= 0x80 && data[0] < 0xf0;
+    }
+
+    Slot* findSlot(const juce::uint8* data, int numBytes) noexcept
+    {
+        if (numBytes < 2 || !isChannelMessage(data, numBytes))
+            return nullptr;
+
+        const auto channel = data[0] & 0x0f;
+
+        switch (data[0] & 0xf0)
+        {
+        case 0xe0:
+            return numBytes == 3 ? &slots[channel][pitchbend] : nullptr;
+
+        case 0xd0:
+            return &slots[channel][pressure];
+
+        case 0xb0:
+            return numBytes == 3 && data[1] == 74 ? &slots[channel][timbre] : nullptr;
+
+        default:
+            return nullptr;
+        }
+    }
+
+    void flushChannel(int channel)
+    {
+        for (auto& slot : slots[(size_t)channel])
+        {
+            if (!slot.pending)
+                continue;
+
+            // MidiBuffer keeps events sorted, so this lands in the right place
+            // even though it's added after later messages on other channels.
+            scratch.addEvent(slot.bytes.data(), slot.numBytes, slot.samplePosition);
+            slot.pending = false;
+        }
+    }
+
+    void flushAll()
+    {
+        for (auto channel = 0; channel < numChannels; ++channel)
+            flushChannel(channel);
+    }
+
+    void updateWindowLength()
+    {
+        windowSamples = windowSeconds > 0.0 ? jmax(1, roundToInt(windowSeconds * sampleRate)) : 0;
+    }
+
+    double sampleRate = 44100.0;
+    double windowSeconds = 0.0;
+    int windowSamples = 0;
+
+    std::array<std::array<Slot, numKinds>, numChannels> slots;
+    MidiBuffer scratch;
+
+    std::atomic<juce::uint32> mergedMessages{ 0 };
+
+    JUCE_DECLARE_NON_COPYABLE(MidiCoalescer)
+};
@@ -0,0 +1,99 @@
+/*
+  ==============================================================================
+
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+//==============================================================================
+// Moves MIDI events back onto a grid of 'granularity' samples, except for
+// note-ons, which keep their exact timestamps.
+// MPESynthesiser splits the render at every distinct timestamp, and each
+// split costs a round of per-voice setup. MPESynthesiserBase can already
+// enforce a minimum sub-block size, but it does so by handling events early,
+// note-ons included. This pass is for when note-ons have to stay
+// sample-accurate: everything else lands on the grid, so the only splits left
+// are grid lines and note-ons.
+// An event is never moved earlier than a note-on that came before it on the
+// same channel, so a note's initial pitchbend and pressure still apply to the
+// right note. Audio thread only.
+class MidiEventQuantiser final
+{
+public:
+    MidiEventQuantiser()
+    {
+        scratch.ensureSize(initialScratchBytes);
+    }
+
+    // Zero or one turns the pass off.
+    void setGranularity(int numSamples)
+    {
+        granularity = jmax(0, numSamples);
+    }
+
+    int getGranularity() const noexcept
+    {
+        return granularity;
+    }
+
+    void process(MidiBuffer& midi)
+    {
+        if (granularity <= 1 || midi.isEmpty())
+            return;
+
+        scratch.clear();
+        scratch.ensureSize((size_t)midi.data.size());
+        lastNoteOn.fill(0);
+
+        for (const auto metadata : midi)
+        {
+            const auto* data = metadata.data;
+            auto time = metadata.samplePosition;
+
+            const auto isChannelMessage = metadata.numBytes > 0 && data[0] >= 0x80 && data[0] < 0xf0;
+            const auto isNoteOn = metadata.numBytes == 3 && (data[0] & 0xf0) == 0x90 && data[2] != 0;
+
+            if (isNoteOn)
+            {
+                lastNoteOn[(size_t)(data[0] & 0x0f)] = time;
+            }
+            else
+            {
+                time -= time % granularity;
+
+                if (isChannelMessage)
+                    time = jmax(time, lastNoteOn[(size_t)(data[0] & 0x0f)]);
+            }
+
+            // Per channel the new timestamps never go backwards, and
+            // MidiBuffer inserts after any events with the same time, so the
+            // order of events on each channel is unchanged.
+            scratch.addEvent(data, metadata.numBytes, time);
+        }
+
+        midi.swapWith(scratch);
+    }
+
+private:
+    enum { numChannels = 16, initialScratchBytes = 4096 };
+
+    int granularity = 0;
+    std::array<int, numChannels> lastNoteOn{};
+    MidiBuffer scratch;
+
+    JUCE_DECLARE_NON_COPYABLE(MidiEventQuantiser)
+};
@@ -26,6 +26,7 @@
 #include <sstream>
 #include <functional>
 #include <mutex>
+#include <new>
 
 namespace IDs
 {
@@ -47,15 +48,18 @@ namespace IDs
     DECLARE_ID(ampEnvSustain)
     DECLARE_ID(ampEnvRelease)
     DECLARE_ID(ampEnvModAmt)
+    DECLARE_ID(ampEnvCurve)
 
     DECLARE_ID(filterActive)
     DECLARE_ID(filterCutoff)
+    DECLARE_ID(filterType)
 
     DECLARE_ID(filterEnvAttack)
     DECLARE_ID(filterEnvDecay)
     DECLARE_ID(filterEnvSustain)
     DECLARE_ID(filterEnvRelease)
     DECLARE_ID(filterEnvModAmt)
+    DECLARE_ID(filterEnvCurve)
 
     DECLARE_ID(MPE_SETTINGS)
     DECLARE_ID(synthVoices)
@@ -0,0 +1,127 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "RenderThreadPool.h"
+
+//==============================================================================
+// Renders a list of voices across a RenderThreadPool.
+// Every voice renders into its own cleared scratch buffer, whichever thread
+// happens to pick it up. Once they're all done, the scratch buffers are added
+// into the output one at a time in list order. Each voice adds each of its
+// samples to the output exactly once, so the sum comes out bit-identical to
+// rendering the voices one after another on a single thread.
+// All scratch space is allocated up front for maxNumVoices voices of up to
+// maxNumSamples samples each.
+template <typename Voice>
+class ParallelVoiceRenderer final
+{
+public:
+    ParallelVoiceRenderer(RenderThreadPool& poolIn, int maxNumVoicesIn, int maxNumSamplesIn)
+        : pool(poolIn),
+        maxNumVoices(jmax(1, maxNumVoicesIn)),
+        maxNumSamples(jmax(1, maxNumSamplesIn)),
+        scratch((size_t)(maxNumVoices * numScratchChannels * maxNumSamples)),
+        rendered((size_t)maxNumVoices)
+    {}
+
+    RenderThreadPool& getPool() const noexcept
+    {
+        return pool;
+    }
+
+    template <typename Element>
+    void render(const std::vector<Voice*>& voices,
+        juce::AudioBuffer<Element>& output,
+        int startSample,
+        int numSamples)
+    {
+        jassert(numSamples <= maxNumSamples);
+        jassert((int)voices.size() <= maxNumVoices);
+
+        Job<Element> job(*this, voices, jmin((int)numScratchChannels, output.getNumChannels()), numSamples);
+        pool.run(job, (int)voices.size());
+
+        for (size_t i = 0; i < voices.size(); ++i)
+        {
+            if (!rendered[i])
+                continue;
+
+            for (auto channel = 0; channel < job.numChannels; ++channel)
+                output.addFrom(channel, startSample, job.getScratch((int)i, channel), numSamples);
+        }
+    }
+
+private:
+    enum { numScratchChannels = 2 };
+
+    template <typename Element>
+    struct Job final : RenderThreadPool::Job
+    {
+        Job(ParallelVoiceRenderer& ownerIn, const std::vector<Voice*>& voicesIn, int numChannelsIn, int numSamplesIn)
+            : owner(ownerIn),
+            voices(voicesIn),
+            numChannels(numChannelsIn),
+            numSamples(numSamplesIn)
+        {}
+
+        // The scratch space is reserved in doubles, so it's big enough for
+        // either sample type.
+        Element* getScratch(int voiceIndex, int channel) const noexcept
+        {
+            auto* base = reinterpret_cast<Element*> (owner.scratch.data());
+            return base + ((size_t)voiceIndex * numScratchChannels + (size_t)channel) * (size_t)owner.maxNumSamples;
+        }
+
+        void runTask(int taskIndex) override
+        {
+            auto* voice = voices[(size_t)taskIndex];
+            auto& wasRendered = owner.rendered[(size_t)taskIndex];
+
+            if (!voice->isActive())
+            {
+                wasRendered = false;
+                return;
+            }
+
+            Element* channels[numScratchChannels] = { getScratch(taskIndex, 0), getScratch(taskIndex, 1) };
+
+            // This refers to the scratch space rather than allocating.
+            juce::AudioBuffer<Element> buffer(channels, numChannels, numSamples);
+            buffer.clear();
+
+            voice->renderNextBlock(buffer, 0, numSamples);
+            wasRendered = true;
+        }
+
+        ParallelVoiceRenderer& owner;
+        const std::vector<Voice*>& voices;
+        const int numChannels;
+        const int numSamples;
+    };
+
+    RenderThreadPool& pool;
+    const int maxNumVoices;
+    const int maxNumSamples;
+
+    std::vector<double> scratch;
+
+    // Written by whichever thread renders each voice. A plain char per voice
+    // keeps neighbouring writes from being a data race.
+    std::vector<char> rendered;
+
+    JUCE_DECLARE_NON_COPYABLE(ParallelVoiceRenderer)
+};
@@ -15,6 +15,24 @@
 
 #pragma once
 
+// The parts of the processor state that are owned by the audio thread.
+// A copy is published after every batch of commands, so this must stay cheap
+// to copy and must never allocate.
+struct ProcessorSnapshot
+{
+    juce::uint32 version = 0;
+    int synthVoices = 0;
+    bool legacyModeEnabled = false;
+    Range<int> legacyChannels;
+    int legacyPitchbendRange = 0;
+    bool voiceStealingEnabled = false;
+    juce::MPEZone lowerZone{ juce::MPEZone::Type::lower };
+    juce::MPEZone upperZone{ juce::MPEZone::Type::upper };
+    Range<double> loopPointsSeconds;
+    double centreFrequencyHz = 440.0;
+    LoopMode loopMode = LoopMode::none;
+};
+
 struct ProcessorState
 {
     int synthVoices;
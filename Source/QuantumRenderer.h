@@ -0,0 +1,159 @@
+/*
+  ==============================================================================
+
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+//==============================================================================
+// Drives a render callback in fixed-size quanta, whatever block size the host
+// uses.
+// If the host's maximum block size is a multiple of the quantum, blocks are
+// simply rendered one quantum at a time in place, with no added latency. The
+// rare short block (e.g. at the end of an offline render) is rendered as a
+// single shorter piece.
+// Otherwise MIDI is collected into an input FIFO until a whole quantum is
+// available, and the rendered audio is played back out of an output FIFO. This
+// costs exactly one quantum of latency, which the owner should report to the
+// host.
+// The render callback is called as render(buffer, midi, startSample,
+// numSamples) and must add its output to the buffer.
+template <typename Element>
+class QuantumRenderer final
+{
+public:
+    QuantumRenderer() = default;
+
+    // Message thread only, while the audio thread is stopped. A quantum of
+    // zero passes every block straight through.
+    void prepare(int newQuantum, int maximumBlockSize, int numChannels)
+    {
+        quantum = jmax(0, newQuantum);
+        buffered = quantum > 0 && maximumBlockSize % quantum != 0;
+
+        if (buffered)
+        {
+            outputFifo.setSize(jmax(1, numChannels), quantum);
+            midiFifo.ensureSize(initialMidiBytes);
+        }
+        else
+        {
+            outputFifo.setSize(0, 0);
+        }
+
+        reset();
+    }
+
+    void reset()
+    {
+        outputFifo.clear();
+        midiFifo.clear();
+
+        // The output FIFO starts out holding one quantum of silence.
+        numAccumulated = 0;
+    }
+
+    int getQuantum() const noexcept
+    {
+        return quantum;
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return buffered ? quantum : 0;
+    }
+
+    // True if nothing but silence is waiting in the FIFOs, so a block can be
+    // skipped with advanceSilently() instead of process().
+    bool isSilent() const noexcept
+    {
+        return !buffered || (midiFifo.isEmpty() && outputFifo.hasBeenCleared());
+    }
+
+    void advanceSilently(int numSamples) noexcept
+    {
+        jassert(isSilent());
+
+        if (buffered)
+            numAccumulated = (numAccumulated + numSamples) % quantum;
+    }
+
+    template <typename Render>
+    void process(juce::AudioBuffer<Element>& buffer, const MidiBuffer& midi, Render&& render)
+    {
+        const auto numSamples = buffer.getNumSamples();
+
+        if (quantum <= 0)
+        {
+            render(buffer, midi, 0, numSamples);
+            return;
+        }
+
+        if (!buffered)
+        {
+            auto start = 0;
+
+            for (; start + quantum <= numSamples; start += quantum)
+                render(buffer, midi, start, quantum);
+
+            if (start < numSamples)
+                render(buffer, midi, start, numSamples - start);
+
+            return;
+        }
+
+        // The output FIFO always holds (quantum - numAccumulated) samples that
+        // haven't been played yet, so input and output advance together.
+        const auto numChannels = jmin(buffer.getNumChannels(), outputFifo.getNumChannels());
+
+        for (auto pos = 0; pos < numSamples;)
+        {
+            const auto numToMove = jmin(numSamples - pos, quantum - numAccumulated);
+
+            for (auto channel = 0; channel < numChannels; ++channel)
+                buffer.copyFrom(channel, pos, outputFifo, channel, numAccumulated, numToMove);
+
+            for (auto channel = numChannels; channel < buffer.getNumChannels(); ++channel)
+                buffer.clear(channel, pos, numToMove);
+
+            midiFifo.addEvents(midi, pos, numToMove, numAccumulated - pos);
+
+            pos += numToMove;
+            numAccumulated += numToMove;
+
+            if (numAccumulated == quantum)
+            {
+                outputFifo.clear();
+                render(outputFifo, midiFifo, 0, quantum);
+                midiFifo.clear();
+                numAccumulated = 0;
+            }
+        }
+    }
+
+private:
+    enum { initialMidiBytes = 4096 };
+
+    int quantum = 0;
+    bool buffered = false;
+    int numAccumulated = 0;
+
+    juce::AudioBuffer<Element> outputFifo;
+    MidiBuffer midiFifo;
+
+    JUCE_DECLARE_NON_COPYABLE(QuantumRenderer)
+};
@@ -0,0 +1,285 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+//==============================================================================
+// A small set of real-time priority threads that help audio threads get
+// through batches of independent tasks.
+// A calling thread posts a job and then works on it alongside the workers.
+// Tasks are handed out one at a time from a shared counter, so whoever is
+// free takes the next one and uneven tasks balance themselves out. run()
+// returns once every task has finished, so from the caller's point of view
+// it behaves just like a loop.
+// Several threads may call run() at once, e.g. when the host processes a
+// number of plugin instances in parallel and they all share getShared().
+// Each job takes one of a fixed number of slots, and the workers help out
+// wherever there is work left. If every slot is busy, the caller simply runs
+// its tasks by itself.
+// Jobs are never held back to be batched with later ones, since every run()
+// has to finish within its own caller's block. So instances that a host
+// calls one after another on a single thread share the workers, one job at
+// a time, but their voices aren't rendered together.
+// Workers render with the same denormal handling as the thread that posted
+// the job, so the output matches rendering on that thread alone.
+// Nothing here allocates once the threads are running. A worker that runs
+// out of work spins for a moment, since the next slice of a block usually
+// follows straight away, and then goes to sleep. Waking a sleeping worker
+// means signalling a juce::WaitableEvent, which takes a lock, so run() only
+// does that for workers that really are asleep. In practice that's once per
+// worker at the start of each block, rather than for every job. An idle pool
+// costs nothing.
+class RenderThreadPool final
+{
+public:
+    struct Job
+    {
+        virtual ~Job() = default;
+        virtual void runTask(int taskIndex) = 0;
+    };
+
+    // Message thread only.
+    explicit RenderThreadPool(int numWorkers)
+    {
+        for (auto i = 0; i < numWorkers; ++i)
+            workers.add(new Worker(*this, i));
+
+        for (auto* worker : workers)
+            worker->startRealtimeThread(juce::Thread::RealtimeOptions{});
+    }
+
+    ~RenderThreadPool()
+    {
+        for (auto* worker : workers)
+        {
+            worker->signalThreadShouldExit();
+            worker->wake.signal();
+        }
+
+        for (auto* worker : workers)
+            worker->stopThread(1000);
+    }
+
+    // Leaves one core for the host's own audio thread.
+    static int getDefaultNumWorkers()
+    {
+        return jmax(0, juce::SystemStats::getNumPhysicalCpus() - 1);
+    }
+
+    // One pool for the whole process, sized to the machine, which stays alive
+    // for as long as anyone holds on to it. Message thread only.
+    static std::shared_ptr<RenderThreadPool> getShared()
+    {
+        static std::mutex mutex;
+        static std::weak_ptr<RenderThreadPool> shared;
+
+        const std::lock_guard<std::mutex> lock(mutex);
+        auto pool = shared.lock();
+
+        if (pool == nullptr)
+        {
+            pool = std::make_shared<RenderThreadPool>(getDefaultNumWorkers());
+            shared = pool;
+        }
+
+        return pool;
+    }
+
+    int getNumWorkers() const noexcept
+    {
+        return workers.size();
+    }
+
+    // Runs job.runTask(i) once for every i in [0, numTasks), and returns when
+    // they have all finished.
+    void run(Job& job, int numTasks)
+    {
+        if (numTasks <= 0)
+            return;
+
+        auto* slot = claimSlot();
+
+        if (slot == nullptr)
+        {
+            for (auto i = 0; i < numTasks; ++i)
+                job.runTask(i);
+
+            return;
+        }
+
+        slot->nextTask.store(0, std::memory_order_relaxed);
+        slot->tasksDone.store(0, std::memory_order_relaxed);
+        slot->totalTasks.store(numTasks, std::memory_order_relaxed);
+        slot->denormalsDisabled.store(juce::FloatVectorOperations::areDenormalsDisabled(), std::memory_order_relaxed);
+        slot->job.store(&job);
+
+        const auto numToWake = jmin(workers.size(), numTasks - 1);
+
+        for (auto i = 0; i < numToWake; ++i)
+            workers.getUnchecked(i)->wakeIfAsleep();
+
+        work(*slot, job);
+
+        while (slot->tasksDone.load(std::memory_order_acquire) < numTasks)
+        {
+        }
+
+        // A worker that woke up late may still be looking at the job, so
+        // wait until it has let go before the slot can be reused.
+        slot->job.store(nullptr);
+
+        while (slot->numHelpers.load() != 0)
+        {
+        }
+
+        slot->claimed.store(false, std::memory_order_release);
+    }
+
+private:
+    class Worker final : public juce::Thread
+    {
+    public:
+        Worker(RenderThreadPool& ownerIn, int index)
+            : juce::Thread("Sampler render " + String(index)),
+            owner(ownerIn)
+        {}
+
+        void run() override
+        {
+            auto idleSince = juce::Time::getHighResolutionTicks();
+
+            while (!threadShouldExit())
+            {
+                if (owner.hasJobs())
+                {
+                    if (owner.helpAll())
+                        idleSince = juce::Time::getHighResolutionTicks();
+
+                    continue;
+                }
+
+                if (juce::Time::getHighResolutionTicks() - idleSince < spinTicks)
+                    continue;
+
+                // Announcing that we're asleep before the last look for work
+                // pairs with run() publishing its job before checking.
+                sleeping.store(true);
+
+                if (!owner.hasJobs())
+                    wake.wait(-1);
+
+                sleeping.store(false);
+                idleSince = juce::Time::getHighResolutionTicks();
+            }
+        }
+
+        void wakeIfAsleep()
+        {
+            if (sleeping.exchange(false))
+                wake.signal();
+        }
+
+        juce::WaitableEvent wake;
+
+    private:
+        RenderThreadPool& owner;
+        std::atomic<bool> sleeping{ false };
+
+        const juce::int64 spinTicks = juce::Time::secondsToHighResolutionTicks(0.0001);
+    };
+
+    struct Slot
+    {
+        std::atomic<bool> claimed{ false };
+        std::atomic<Job*> job{ nullptr };
+        std::atomic<int> totalTasks{ 0 };
+        std::atomic<int> nextTask{ 0 };
+        std::atomic<int> tasksDone{ 0 };
+        std::atomic<int> numHelpers{ 0 };
+        std::atomic<bool> denormalsDisabled{ false };
+    };
+
+    enum { maxConcurrentJobs = 16 };
+
+    Slot* claimSlot() noexcept
+    {
+        for (auto& slot : slots)
+            if (!slot.claimed.exchange(true, std::memory_order_acquire))
+                return &slot;
+
+        return nullptr;
+    }
+
+    // Returns true if any tasks were run.
+    static bool work(Slot& slot, Job& job)
+    {
+        const auto numTasks = slot.totalTasks.load(std::memory_order_relaxed);
+        auto didWork = false;
+
+        for (;;)
+        {
+            const auto index = slot.nextTask.fetch_add(1, std::memory_order_relaxed);
+
+            if (index >= numTasks)
+                break;
+
+            job.runTask(index);
+            slot.tasksDone.fetch_add(1, std::memory_order_release);
+            didWork = true;
+        }
+
+        return didWork;
+    }
+
+    bool hasJobs() const noexcept
+    {
+        for (auto& slot : slots)
+            if (slot.job.load() != nullptr)
+                return true;
+
+        return false;
+    }
+
+    bool helpAll()
+    {
+        auto didWork = false;
+
+        for (auto& slot : slots)
+        {
+            // Registering before looking at the job pairs with run() clearing
+            // the job before it checks numHelpers.
+            slot.numHelpers.fetch_add(1);
+
+            if (auto* job = slot.job.load())
+            {
+                const auto disableDenormals = slot.denormalsDisabled.load(std::memory_order_relaxed);
+
+                if (juce::FloatVectorOperations::areDenormalsDisabled() != disableDenormals)
+                    juce::FloatVectorOperations::disableDenormalisedNumberSupport(disableDenormals);
+
+                didWork = work(slot, *job) || didWork;
+            }
+
+            slot.numHelpers.fetch_sub(1, std::memory_order_release);
+        }
+
+        return didWork;
+    }
+
+    OwnedArray<Worker> workers;
+    std::array<Slot, maxConcurrentJobs> slots;
+
+    JUCE_DECLARE_NON_COPYABLE(RenderThreadPool)
+};
@@ -15,15 +15,24 @@
 
 #pragma once
 
+#include "SampleData.h"
+
 //==============================================================================
 // Represents the constant parts of an audio sample: its name, sample rate,
 // length, and the audio sample data itself.
 // Samples might be pretty big, so we'll keep shared_ptrs to them most of the
 // time, to reduce duplication and copying.
+// The data can be stored planar or interleaved, see SampleData.
+// To save memory, SampleMemoryBudget can move the bulk of a long sample out
+// to a file on disk while it isn't playing. The head of the sample always
+// stays in memory, so a note can start straight away, and the rest is read
+// back in, a chunk at a time, as soon as one does. Voices bracket the time
+// they spend reading a sample with startedPlaying() and stoppedPlaying(), and
+// the data is never moved out while anyone is reading it.
 class Sample final
 {
 public:
-    Sample(AudioFormatReader& source, double maxSampleLengthSecs)
+    Sample(AudioFormatReader& source, double maxSampleLengthSecs, SampleLayout layout = SampleLayout::planar)
         : m_sourceSampleRate(source.sampleRate),
         m_length(jmin(int(source.lengthInSamples),
             int(maxSampleLengthSecs* m_sourceSampleRate))),
@@ -34,10 +43,10 @@ public:
 
         source.read(&m_temp_data, 0, m_length + 4, 0, true, true);
 
-        upsample(8);
+        upsample(8, layout);
     }
 
-    Sample(std::vector<std::vector<float>> soundData, double sr) : m_sourceSampleRate{ sr },
+    Sample(std::vector<std::vector<float>> soundData, double sr, SampleLayout layout = SampleLayout::planar) : m_sourceSampleRate{ sr },
         m_length((int)soundData.at(0).size()) {
 
         int numChans = (int) soundData.size();
@@ -49,39 +58,378 @@ public:
             m_temp_data.copyFrom(chan, 0, soundData.at(chan).data(), m_length);
         }
 
-        upsample(8);
+        upsample(8, layout);
+    }
+
+    ~Sample()
+    {
+        for (auto* copy = m_hostRateCopies.load(); copy != nullptr;)
+            delete std::exchange(copy, copy->next);
+
+        if (m_spillFile != juce::File())
+            m_spillFile.deleteFile();
     }
 
     double getSampleRate() const { return m_sourceSampleRate; }
     int getLength() const { return m_length; }
-    const juce::AudioBuffer<float>& getBuffer() const { return m_data; }
+
+    // What a voice should read from right now, and how many frames of it are
+    // ready to read. That's all of the data when it's in memory, as much of
+    // it as has arrived while it's being read back in from disk, or else just
+    // the head. Once the caller has called startedPlaying(), whatever this
+    // returns stays valid until it calls stoppedPlaying(), and the number of
+    // frames ready only ever grows.
+    const SampleData& getPlayableData(int& numFramesReady) const noexcept
+    {
+        auto& head = getHead();
+
+        if (const auto* data = m_resident.load())
+        {
+            const auto numLoaded = m_numFramesLoaded.load(std::memory_order_acquire);
+
+            if (numLoaded >= head.getNumFrames())
+            {
+                numFramesReady = numLoaded;
+                return *data;
+            }
+        }
+
+        numFramesReady = head.getNumFrames();
+        return head;
+    }
+
+    // The start of the data, which is always in memory. For short samples
+    // this is all of it.
+    const SampleData& getHead() const noexcept
+    {
+        return m_headIsWhole ? *m_data : m_head;
+    }
+
+    int getNumFrames() const noexcept { return m_numFrames; }
+
+    // Audio thread safe. If the data isn't all in memory, this asks for it
+    // back.
+    void startedPlaying() const noexcept
+    {
+        m_numPlaying.fetch_add(1);
+        m_lastPlayed.store(juce::Time::getMillisecondCounter(), std::memory_order_relaxed);
+
+        if (!isResident())
+            m_promotionWanted.store(true, std::memory_order_relaxed);
+    }
+
+    void stoppedPlaying() const noexcept
+    {
+        jassert(m_numPlaying.load() > 0);
+        m_numPlaying.fetch_sub(1);
+    }
+
+    // Called by a voice that caught up with the end of the data that's in
+    // memory before the rest of it had been read back in.
+    void streamUnderrun() const noexcept
+    {
+        m_underruns.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    juce::uint32 getNumUnderruns() const noexcept { return m_underruns.load(std::memory_order_relaxed); }
+    juce::uint32 getLastPlayed() const noexcept { return m_lastPlayed.load(std::memory_order_relaxed); }
+    bool isPlaying() const noexcept { return m_numPlaying.load() > 0; }
+    bool canBeDemoted() const noexcept { return !m_headIsWhole; }
+    bool wantsPromotion() const noexcept { return m_promotionWanted.load(std::memory_order_relaxed); }
+
+    // True once all of the data is in memory.
+    bool isResident() const noexcept
+    {
+        return m_resident.load() != nullptr && m_numFramesLoaded.load(std::memory_order_acquire) == m_numFrames;
+    }
+
+    // The memory the full data takes up when it's resident, and the memory
+    // the head takes up on top of that.
+    size_t getFullBytes() const noexcept { return m_fullBytes; }
+    size_t getHeadBytes() const noexcept { return m_headIsWhole ? 0 : m_head.getNumBytes(); }
+
+    // The memory taken up by the copies made with makeHostRateCopy().
+    size_t getHostRateCopyBytes() const noexcept { return m_hostRateCopyBytes.load(std::memory_order_relaxed); }
+
+    // Everything this sample has in memory right now.
+    size_t getBytesInMemory() const noexcept
+    {
+        return (m_resident.load() != nullptr ? m_fullBytes : 0) + getHeadBytes() + getHostRateCopyBytes();
+    }
+
+    //==============================================================================
+    // Moving the data in and out of memory doesn't change the sample, so these
+    // are const. They block, so don't call them on the audio thread, unless
+    // it's rendering offline and can afford to wait.
+
+    // Writes the data out to disk, if it isn't there already, and frees it,
+    // along with any host-rate copies. Returns false if the sample is playing,
+    // is too short to be worth it, or the file couldn't be written.
+    bool demote() const
+    {
+        const std::lock_guard<std::mutex> lock(m_residencyMutex);
+
+        if (m_headIsWhole || m_data == nullptr || isPlaying())
+            return false;
+
+        if (m_spillFile == juce::File())
+        {
+            auto file = juce::File::createTempFile(".samplerdata");
+            juce::FileOutputStream out(file);
+
+            if (!out.openedOk() || !m_data->writeTo(out))
+            {
+                file.deleteFile();
+                return false;
+            }
+
+            out.flush();
+            m_spillFile = file;
+        }
+
+        const std::lock_guard<std::mutex> copyLock(m_hostRateCopyMutex);
+
+        // A voice that starts playing from here on sees that the data and the
+        // copies have gone. If one started before it could, back off and try
+        // again later.
+        m_resident.store(nullptr);
+        auto* copies = m_hostRateCopies.exchange(nullptr);
+
+        if (isPlaying())
+        {
+            m_hostRateCopies.store(copies);
+            m_resident.store(m_data.get());
+            return false;
+        }
+
+        m_data.reset();
+        m_numFramesLoaded.store(0);
+
+        while (copies != nullptr)
+            delete std::exchange(copies, copies->next);
+
+        m_hostRateCopyBytes.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Reads the data back in from disk, a chunk at a time. The head is copied
+    // in first, and voices can read each chunk as soon as it has arrived, so
+    // a note that has run on past the head only waits for the part it's
+    // about to play rather than for the whole sample. Then the host-rate
+    // copies that were freed with the data are made again.
+    // Returns false if the data couldn't be read, in which case calling this
+    // again carries on from where it stopped.
+    bool promote() const
+    {
+        const std::lock_guard<std::mutex> lock(m_residencyMutex);
+        m_promotionWanted.store(false, std::memory_order_relaxed);
+
+        if (isResident())
+            return true;
+
+        juce::FileInputStream in(m_spillFile);
+
+        if (!in.openedOk())
+            return false;
+
+        if (m_data == nullptr)
+        {
+            m_data = std::make_unique<SampleData>(m_head.getNumChannels(), m_numFrames, m_head.getLayout());
+            m_data->copyFramesFrom(m_head, m_head.getNumFrames());
+            m_numFramesLoaded.store(m_head.getNumFrames(), std::memory_order_release);
+            m_resident.store(m_data.get());
+        }
+
+        const auto chunkFrames = jmax(1, (int)(streamChunkSeconds * m_sourceSampleRate));
+
+        for (auto start = m_numFramesLoaded.load(); start < m_numFrames; start += chunkFrames)
+        {
+            const auto numToRead = jmin(chunkFrames, m_numFrames - start);
+
+            if (!m_data->readFrames(in, start, numToRead))
+                return false;
+
+            m_numFramesLoaded.store(start + numToRead, std::memory_order_release);
+        }
+
+        m_data->lockInMemory();
+
+        std::vector<double> hostRates;
+
+        {
+            const std::lock_guard<std::mutex> copyLock(m_hostRateCopyMutex);
+            hostRates = m_hostRates;
+        }
+
+        for (auto rate : hostRates)
+            makeHostRateCopy(rate);
+
+        return true;
+    }
+
+    // The sample resampled to exactly some playback rate, so that a voice
+    // playing it back at that rate, or a whole multiple of it, can read it
+    // sample by sample without interpolating.
+    struct HostRateCopy
+    {
+        double sampleRate = 0.0;
+        int length = 0;
+        SampleData data;
+        HostRateCopy* next = nullptr;
+    };
+
+    // Returns the copy made at hostSampleRate, or nullptr if there isn't one
+    // yet. Lock-free, so it's fine to call on the audio thread.
+    // Once the caller has called startedPlaying(), the copy stays valid until
+    // it calls stoppedPlaying().
+    const HostRateCopy* getHostRateCopy(double hostSampleRate) const noexcept
+    {
+        for (auto* copy = m_hostRateCopies.load(); copy != nullptr; copy = copy->next)
+            if (copy->sampleRate == hostSampleRate)
+                return copy;
+
+        return nullptr;
+    }
+
+    // Makes the copy for hostSampleRate, unless it already exists. This can
+    // take a while for long samples, so call it on a background thread.
+    // If the data isn't all in memory, the copy is made when it's next read
+    // back in. Copies are freed along with the data by demote().
+    void makeHostRateCopy(double hostSampleRate) const
+    {
+        if (hostSampleRate <= 0.0 || getHostRateCopy(hostSampleRate) != nullptr)
+            return;
+
+        const std::lock_guard<std::mutex> lock(m_hostRateCopyMutex);
+
+        if (std::find(m_hostRates.begin(), m_hostRates.end(), hostSampleRate) == m_hostRates.end())
+            m_hostRates.push_back(hostSampleRate);
+
+        if (getHostRateCopy(hostSampleRate) != nullptr)
+            return;
+
+        // Hold on to the data while it's being read, if it's all in memory.
+        // If it isn't, the copy will have to wait until it is.
+        m_numPlaying.fetch_add(1);
+
+        if (!isResident())
+        {
+            m_numPlaying.fetch_sub(1);
+            return;
+        }
+
+        const auto* data = m_resident.load();
+        auto copy = std::make_unique<HostRateCopy>();
+        copy->sampleRate = hostSampleRate;
+
+        // The last host-rate sample lands on or before the end of the
+        // upsampled data, just like the last position a voice will play.
+        const auto step = m_sourceSampleRate / hostSampleRate;
+        copy->length = (int)(m_length / step) + 1;
+        copy->data = SampleData(data->getNumChannels(), copy->length, data->getLayout());
+
+        // The interpolator wants each channel in one contiguous piece.
+        std::vector<float> source((size_t)data->getNumFrames());
+        std::vector<float> resampled((size_t)copy->length);
+
+        for (auto chan = 0; chan < data->getNumChannels(); ++chan)
+        {
+            data->copyChannel(chan, source.data());
+
+            LagrangeInterpolator interpolator;
+            interpolator.process(step, source.data(), resampled.data(), copy->length, (int)source.size(), 0);
+            copy->data.setChannel(chan, resampled.data());
+        }
+
+        m_numPlaying.fetch_sub(1);
+        copy->data.lockInMemory();
+
+        m_hostRateCopyBytes.fetch_add(copy->data.getNumBytes(), std::memory_order_relaxed);
+        copy->next = m_hostRateCopies.load();
+        m_hostRateCopies.store(copy.release());
+    }
 
 private:
     double m_sourceSampleRate;
     int m_length;
     juce::AudioBuffer<float> m_temp_data;
-    juce::AudioBuffer<float> m_data;
+
+    // How much of a long sample always stays in memory, and how much of the
+    // rest is read back in from disk at a time.
+    static constexpr double headSeconds = 0.5;
+    static constexpr double streamChunkSeconds = 0.25;
+
+    mutable std::unique_ptr<SampleData> m_data;
+    mutable std::atomic<const SampleData*> m_resident{ nullptr };
+    mutable std::atomic<int> m_numFramesLoaded{ 0 };
+    SampleData m_head;
+    bool m_headIsWhole = true;
+    int m_numFrames = 0;
+    size_t m_fullBytes = 0;
+    mutable juce::File m_spillFile;
+    mutable std::mutex m_residencyMutex;
+
+    mutable std::atomic<int> m_numPlaying{ 0 };
+    mutable std::atomic<juce::uint32> m_lastPlayed{ 0 };
+    mutable std::atomic<bool> m_promotionWanted{ false };
+    mutable std::atomic<juce::uint32> m_underruns{ 0 };
 
     LagrangeInterpolator m_interpolator;
 
+    mutable std::atomic<HostRateCopy*> m_hostRateCopies{ nullptr };
+    mutable std::atomic<size_t> m_hostRateCopyBytes{ 0 };
+    mutable std::vector<double> m_hostRates;
+    mutable std::mutex m_hostRateCopyMutex;
+
     // Whenever sample data is given to the Sample class, a Lagrange interpolator upsamples it in order
     // to be able to play it back at at different speeds with low aliasing artifacts. Therefore, upsample()
     // must be called in each constructor to Sample().
-    void upsample(int upSampleRatio) {
+    void upsample(int upSampleRatio, SampleLayout layout) {
 
         int numInputSamples = m_temp_data.getNumSamples();
         int numOutputSamples = upSampleRatio * numInputSamples;
 
-        m_data.setSize(2, numOutputSamples, false, true, false);
+        // Mono stays mono, which halves the memory, and lets the voices do
+        // half the work.
+        const auto numChannels = jmin(2, m_temp_data.getNumChannels());
+        m_data = std::make_unique<SampleData>(numChannels, numOutputSamples, layout);
+
+        // Planar data can be upsampled in place. Interleaved data goes via a
+        // contiguous scratch channel.
+        std::vector<float> scratch;
+
+        if (layout != SampleLayout::planar)
+            scratch.resize((size_t)numOutputSamples);
 
-        for (int outChan = 0; outChan < 2; outChan++) {
-            int inChan = m_temp_data.getNumChannels() > 1 ? outChan : 0;
-            m_interpolator.process(1./(double)(upSampleRatio), m_temp_data.getReadPointer(inChan), m_data.getWritePointer(outChan), numOutputSamples, numInputSamples, 0);
+        for (int chan = 0; chan < numChannels; chan++) {
+            auto* dest = scratch.empty() ? m_data->getWritePointer(chan) : scratch.data();
+            m_interpolator.reset();
+            m_interpolator.process(1./(double)(upSampleRatio), m_temp_data.getReadPointer(chan), dest, numOutputSamples, numInputSamples, 0);
+
+            if (!scratch.empty())
+                m_data->setChannel(chan, dest);
         }
 
         m_length *= upSampleRatio;
         m_sourceSampleRate *= upSampleRatio;
 
+        // This happens before the sample is handed to the audio thread, so
+        // no voice ever takes a page fault reading it.
+        m_data->lockInMemory();
+
+        m_numFrames = numOutputSamples;
+        m_fullBytes = m_data->getNumBytes();
+        m_headIsWhole = m_numFrames <= (int)(headSeconds * m_sourceSampleRate);
+
+        if (!m_headIsWhole)
+        {
+            m_head = m_data->copyHead((int)(headSeconds * m_sourceSampleRate));
+            m_head.lockInMemory();
+        }
+
+        m_numFramesLoaded.store(m_numFrames);
+        m_resident.store(m_data.get());
+
         m_temp_data.clear();
     }
 };
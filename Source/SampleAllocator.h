@@ -0,0 +1,251 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+#if JUCE_LINUX
+ #include <sys/mman.h>
+#endif
+
+#if JUCE_LINUX || JUCE_MAC || JUCE_BSD
+ #include <unistd.h>
+#endif
+
+// Where a block of sample memory came from.
+enum class SamplePageKind
+{
+    regular,                // the normal heap
+    transparentHugeAdvised, // mapped on its own and advised to use 2 MB pages
+    explicitHuge            // taken from the system's reserved 2 MB pages
+};
+
+// How much sample memory is currently allocated from each kind of page,
+// across the whole process.
+// The kernel accepting the advice to use transparent huge pages doesn't mean
+// it actually gave us any, since it may not have a free 2 MB page to hand.
+// AnonHugePages in /proc/self/smaps_rollup shows how much it really did.
+struct SampleMemoryStats
+{
+    size_t regularBytes = 0;
+    size_t transparentHugeAdvisedBytes = 0;
+    size_t explicitHugeBytes = 0;
+    juce::uint32 numBlocks = 0;
+
+    size_t getTotalBytes() const noexcept
+    {
+        return regularBytes + transparentHugeAdvisedBytes + explicitHugeBytes;
+    }
+};
+
+//==============================================================================
+// Allocates the memory that sample data lives in.
+// Large samples are read from random places by lots of voices at once, and
+// with 4 KB pages that means a lot of TLB misses. So blocks of at least one
+// huge page come from 2 MB pages if possible: first the system's reserved
+// huge pages, then a 2 MB aligned mapping that's advised to use transparent
+// huge pages, and if neither works, the normal heap. Only Linux has the
+// huge page options at the moment.
+// Every block is zeroed and owns whole pages: blocks from the normal heap
+// are page aligned and rounded up to a whole number of pages. Page locks
+// aren't counted, so locking or unlocking one block must never touch a page
+// that another block shares.
+class SampleAllocator final
+{
+public:
+    struct Block
+    {
+        float* data = nullptr;
+        size_t numBytes = 0;        // what was asked for
+        size_t mappedBytes = 0;     // what was actually reserved, in whole pages
+        SamplePageKind kind = SamplePageKind::regular;
+    };
+
+    static Block allocate(size_t numFloats)
+    {
+        Block block;
+        block.numBytes = numFloats * sizeof(float);
+
+        if (block.numBytes == 0)
+            return block;
+
+       #if JUCE_LINUX
+        if (block.numBytes >= hugePageSize && (allocateExplicitHuge(block) || allocateTransparentHuge(block)))
+        {
+            track(block, true);
+            return block;
+        }
+       #endif
+
+        const auto pageSize = getPageSize();
+        block.mappedBytes = (block.numBytes + pageSize - 1) / pageSize * pageSize;
+        block.data = static_cast<float*> (::operator new (block.mappedBytes, std::align_val_t(pageSize)));
+        std::memset(block.data, 0, block.mappedBytes);
+        block.kind = SamplePageKind::regular;
+
+        track(block, true);
+        return block;
+    }
+
+    static void free(const Block& block) noexcept
+    {
+        if (block.data == nullptr)
+            return;
+
+        track(block, false);
+
+       #if JUCE_LINUX
+        if (block.kind != SamplePageKind::regular)
+        {
+            munmap(block.data, block.mappedBytes);
+            return;
+        }
+       #endif
+
+        ::operator delete (block.data, std::align_val_t(getPageSize()));
+    }
+
+    static size_t getPageSize() noexcept
+    {
+       #if JUCE_LINUX || JUCE_MAC || JUCE_BSD
+        static const auto pageSize = (size_t)jmax(4096L, sysconf(_SC_PAGESIZE));
+        return pageSize;
+       #else
+        return 4096;
+       #endif
+    }
+
+    // Safe to call from any thread.
+    static SampleMemoryStats getStats() noexcept
+    {
+        auto& counters = getCounters();
+
+        SampleMemoryStats stats;
+        stats.regularBytes = counters.bytes[(size_t)SamplePageKind::regular].load(std::memory_order_relaxed);
+        stats.transparentHugeAdvisedBytes = counters.bytes[(size_t)SamplePageKind::transparentHugeAdvised].load(std::memory_order_relaxed);
+        stats.explicitHugeBytes = counters.bytes[(size_t)SamplePageKind::explicitHuge].load(std::memory_order_relaxed);
+        stats.numBlocks = counters.numBlocks.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    static constexpr size_t hugePageSize = 2 * 1024 * 1024;
+
+    struct Counters
+    {
+        std::array<std::atomic<size_t>, 3> bytes{};
+        std::atomic<juce::uint32> numBlocks{ 0 };
+    };
+
+    static Counters& getCounters() noexcept
+    {
+        static Counters counters;
+        return counters;
+    }
+
+    static void track(const Block& block, bool added) noexcept
+    {
+        auto& counters = getCounters();
+        auto& bytes = counters.bytes[(size_t)block.kind];
+
+        if (added)
+        {
+            bytes.fetch_add(block.mappedBytes, std::memory_order_relaxed);
+            counters.numBlocks.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            bytes.fetch_sub(block.mappedBytes, std::memory_order_relaxed);
+            counters.numBlocks.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+   #if JUCE_LINUX
+    static size_t roundUpToHugePage(size_t numBytes) noexcept
+    {
+        return (numBytes + hugePageSize - 1) & ~(hugePageSize - 1);
+    }
+
+    // Fails straight away if no huge pages have been reserved.
+    static bool allocateExplicitHuge(Block& block) noexcept
+    {
+        const auto size = roundUpToHugePage(block.numBytes);
+        auto* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (address == MAP_FAILED)
+            return false;
+
+        block.data = static_cast<float*> (address);
+        block.mappedBytes = size;
+        block.kind = SamplePageKind::explicitHuge;
+        return true;
+    }
+
+    // Only worth trying if the kernel will take the advice. Its setting is
+    // one of "always", "madvise" or "never", with the current one in
+    // brackets.
+    static bool isTransparentHugeAdviceUseful()
+    {
+        static const auto useful = !juce::File("/sys/kernel/mm/transparent_hugepage/enabled")
+            .loadFileAsString().contains("[never]");
+
+        return useful;
+    }
+
+    // Maps a little extra so that the block can start on a 2 MB boundary,
+    // which the kernel needs before it can use huge pages for it, and hands
+    // the extra back. Fails if the kernel won't take the advice, e.g. if it
+    // was built without transparent huge pages.
+    static bool allocateTransparentHuge(Block& block)
+    {
+       #ifdef MADV_HUGEPAGE
+        if (!isTransparentHugeAdviceUseful())
+            return false;
+
+        const auto size = roundUpToHugePage(block.numBytes);
+        auto* mapped = mmap(nullptr, size + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (mapped == MAP_FAILED)
+            return false;
+
+        const auto start = reinterpret_cast<uintptr_t> (mapped);
+        const auto aligned = (start + hugePageSize - 1) & ~(uintptr_t)(hugePageSize - 1);
+        const auto before = (size_t)(aligned - start);
+        const auto after = hugePageSize - before;
+
+        if (before > 0)
+            munmap(mapped, before);
+
+        if (after > 0)
+            munmap(reinterpret_cast<void*> (aligned + size), after);
+
+        auto* address = reinterpret_cast<void*> (aligned);
+
+        if (madvise(address, size, MADV_HUGEPAGE) != 0)
+        {
+            munmap(address, size);
+            return false;
+        }
+
+        block.data = static_cast<float*> (address);
+        block.mappedBytes = size;
+        block.kind = SamplePageKind::transparentHugeAdvised;
+        return true;
+       #else
+        ignoreUnused(block);
+        return false;
+       #endif
+    }
+   #endif
+};
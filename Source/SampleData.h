@@ -0,0 +1,296 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "SampleAllocator.h"
+
+#if JUCE_LINUX || JUCE_MAC || JUCE_BSD
+ #include <sys/mman.h>
+#endif
+
+#if JUCE_MSVC && JUCE_INTEL
+ #include <xmmintrin.h>
+#endif
+
+// How the channels of a sample are arranged in memory.
+enum class SampleLayout
+{
+    planar,         // all of the left channel, then all of the right
+    interleaved     // left and right side by side, frame by frame
+};
+
+//==============================================================================
+// A block of audio frames, stored in either layout.
+// Channel c of frame i is always at getChannel(c)[i * getStride()], so code
+// that reads it doesn't need to care which layout it is. Interleaved data
+// keeps both halves of a stereo frame next to each other, so a voice reading
+// from it touches one stream of memory rather than two.
+// Voices read from all over the data, so it can be locked into memory once
+// it's written, and voices can ask for the part they're about to read to be
+// prefetched. The memory itself comes from SampleAllocator.
+class SampleData final
+{
+public:
+    SampleData() = default;
+
+    SampleData(int numChannelsIn, int numFramesIn, SampleLayout layoutIn)
+        : numChannels(numChannelsIn),
+        numFrames(numFramesIn),
+        layout(layoutIn),
+        block(SampleAllocator::allocate((size_t)numChannels * (size_t)numFrames))
+    {
+        jassert(numChannels > 0 && numFrames >= 0);
+    }
+
+    SampleData(SampleData&& other) noexcept
+    {
+        swapWith(other);
+    }
+
+    SampleData& operator= (SampleData&& other) noexcept
+    {
+        SampleData previous(std::move(other));
+        swapWith(previous);
+        return *this;
+    }
+
+    ~SampleData()
+    {
+        unlock();
+        SampleAllocator::free(block);
+    }
+
+    int getNumChannels() const noexcept { return numChannels; }
+    int getNumFrames() const noexcept { return numFrames; }
+    SampleLayout getLayout() const noexcept { return layout; }
+
+    int getStride() const noexcept
+    {
+        return layout == SampleLayout::interleaved ? numChannels : 1;
+    }
+
+    const float* getChannel(int channel) const noexcept
+    {
+        jassert(juce::isPositiveAndBelow(channel, numChannels));
+        return block.data + getChannelOffset(channel);
+    }
+
+    // Where the memory came from.
+    SamplePageKind getPageKind() const noexcept { return block.kind; }
+
+    size_t getNumBytes() const noexcept { return block.numBytes; }
+
+    // Only for planar data, where each channel is contiguous.
+    float* getWritePointer(int channel) noexcept
+    {
+        jassert(layout == SampleLayout::planar);
+        jassert(juce::isPositiveAndBelow(channel, numChannels));
+        return block.data + getChannelOffset(channel);
+    }
+
+    // Fills one channel from numFrames contiguous samples.
+    void setChannel(int channel, const float* source) noexcept
+    {
+        auto* dest = block.data + getChannelOffset(channel);
+        const auto stride = getStride();
+
+        for (auto i = 0; i < numFrames; ++i)
+            dest[i * stride] = source[i];
+    }
+
+    // Copies one channel out into numFrames contiguous samples.
+    void copyChannel(int channel, float* dest) const noexcept
+    {
+        const auto* source = getChannel(channel);
+        const auto stride = getStride();
+
+        for (auto i = 0; i < numFrames; ++i)
+            dest[i] = source[i * stride];
+    }
+
+    // A new block holding just the first numFramesToCopy frames, in the same
+    // layout.
+    SampleData copyHead(int numFramesToCopy) const
+    {
+        SampleData head(numChannels, juce::jlimit(0, numFrames, numFramesToCopy), layout);
+        head.copyFramesFrom(*this, head.numFrames);
+        return head;
+    }
+
+    // Copies the first numFramesToCopy frames of another block with the same
+    // channels and layout.
+    void copyFramesFrom(const SampleData& source, int numFramesToCopy) noexcept
+    {
+        jassert(source.numChannels == numChannels && source.layout == layout);
+        numFramesToCopy = jmin(numFramesToCopy, numFrames, source.numFrames);
+        const auto stride = getStride();
+
+        for (auto channel = 0; channel < numChannels; ++channel)
+        {
+            const auto* from = source.getChannel(channel);
+            auto* dest = block.data + getChannelOffset(channel);
+
+            for (auto i = 0; i < numFramesToCopy; ++i)
+                dest[i * stride] = from[i * stride];
+        }
+    }
+
+    // Writes the raw data out. Returns false if the stream couldn't take all
+    // of it.
+    bool writeTo(juce::OutputStream& stream) const
+    {
+        return stream.write(block.data, block.numBytes);
+    }
+
+    // Reads numFramesToRead frames, starting at firstFrame, back from what
+    // writeTo() wrote for a block of the same shape. Returns false if the
+    // stream couldn't supply all of them.
+    bool readFrames(juce::InputStream& stream, int firstFrame, int numFramesToRead)
+    {
+        jassert(firstFrame >= 0 && firstFrame + numFramesToRead <= numFrames);
+
+        // Interleaved frames are all in one run, planar ones in one run per
+        // channel.
+        const auto numRuns = layout == SampleLayout::interleaved ? 1 : numChannels;
+        const auto floatsPerFrame = (size_t)getStride();
+        const auto numBytes = (size_t)numFramesToRead * floatsPerFrame * sizeof(float);
+
+        for (auto run = 0; run < numRuns; ++run)
+        {
+            const auto offset = getChannelOffset(run) + (size_t)firstFrame * floatsPerFrame;
+            auto* dest = reinterpret_cast<char*> (block.data + offset);
+
+            if (!stream.setPosition((juce::int64)(offset * sizeof(float))))
+                return false;
+
+            for (size_t done = 0; done < numBytes;)
+            {
+                const auto numRead = stream.read(dest + done, numBytes - done);
+
+                if (numRead <= 0)
+                    return false;
+
+                done += (size_t)numRead;
+            }
+        }
+
+        return true;
+    }
+
+    // Makes sure every page of the data is in memory, and asks the OS to
+    // keep it there, so the audio thread never has to wait for a page fault.
+    // Locking may not be allowed, e.g. if it would take the process over its
+    // limit, in which case the pages are still touched once here, on the
+    // calling thread. Call once the data has been written.
+    // SampleAllocator gives every block pages of its own, so locking or
+    // unlocking one never affects another.
+    void lockInMemory() noexcept
+    {
+        const auto numBytes = block.numBytes;
+
+        if (numBytes == 0 || locked)
+            return;
+
+       #if JUCE_LINUX || JUCE_MAC || JUCE_BSD
+        locked = mlock(block.data, block.mappedBytes) == 0;
+       #endif
+
+        if (!locked)
+        {
+            const auto* bytes = reinterpret_cast<const volatile char*> (block.data);
+
+            for (size_t i = 0; i < numBytes; i += pageSize)
+                ignoreUnused(bytes[i]);
+        }
+    }
+
+    // Asks for the cache lines holding numFramesToFetch frames, starting at
+    // firstFrame, to be fetched ahead of time. Anything outside the data is
+    // ignored. Only a limited number of lines are requested per call, since
+    // a prefetch that comes too early is wasted.
+    void prefetch(int firstFrame, int numFramesToFetch) const noexcept
+    {
+        const auto start = juce::jlimit(0, numFrames, firstFrame);
+        const auto end = juce::jlimit(0, numFrames, firstFrame + numFramesToFetch);
+
+        if (start >= end)
+            return;
+
+        const auto numStreams = layout == SampleLayout::interleaved ? 1 : numChannels;
+        const auto bytesPerFrame = (size_t)getStride() * sizeof(float);
+        const auto numBytes = jmin((size_t)(end - start) * bytesPerFrame, (size_t)maxPrefetchBytes);
+
+        for (auto stream = 0; stream < numStreams; ++stream)
+        {
+            const auto* begin = reinterpret_cast<const char*> (getChannel(stream) + (size_t)start * (size_t)getStride());
+
+            for (size_t offset = 0; offset < numBytes; offset += cacheLineSize)
+                prefetchLine(begin + offset);
+        }
+    }
+
+private:
+    enum
+    {
+        pageSize = 4096,
+        cacheLineSize = 64,
+        maxPrefetchBytes = 4096
+    };
+
+    static void prefetchLine(const void* address) noexcept
+    {
+       #if JUCE_GCC || JUCE_CLANG
+        __builtin_prefetch(address, 0, 3);
+       #elif JUCE_MSVC && JUCE_INTEL
+        _mm_prefetch(static_cast<const char*> (address), _MM_HINT_T0);
+       #else
+        ignoreUnused(address);
+       #endif
+    }
+
+    void unlock() noexcept
+    {
+       #if JUCE_LINUX || JUCE_MAC || JUCE_BSD
+        if (locked)
+            munlock(block.data, block.mappedBytes);
+       #endif
+
+        locked = false;
+    }
+
+    void swapWith(SampleData& other) noexcept
+    {
+        std::swap(numChannels, other.numChannels);
+        std::swap(numFrames, other.numFrames);
+        std::swap(layout, other.layout);
+        std::swap(locked, other.locked);
+        std::swap(block, other.block);
+    }
+
+    size_t getChannelOffset(int channel) const noexcept
+    {
+        return layout == SampleLayout::interleaved ? (size_t)channel
+            : (size_t)channel * (size_t)numFrames;
+    }
+
+    int numChannels = 0;
+    int numFrames = 0;
+    SampleLayout layout = SampleLayout::planar;
+    SampleAllocator::Block block;
+    bool locked = false;
+
+    JUCE_DECLARE_NON_COPYABLE(SampleData)
+};
@@ -0,0 +1,297 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "Sample.h"
+
+//==============================================================================
+// Keeps the sample data of every instance in the process within a memory
+// budget.
+// Whenever the samples in memory add up to more than the budget, the ones
+// that were played least recently have all but their heads moved out to
+// disk, along with their host-rate copies, see Sample::demote(). As soon as
+// a note starts on one of those, it plays from the head while the rest is
+// read back in. Samples that are playing are never moved out.
+// All of this happens on a background thread of its own, which checks every
+// few milliseconds for samples that need reading back in, so the audio
+// thread never has to wake it. The thread isn't started until there's a
+// budget, and it sleeps whenever there's no budget and nothing on disk.
+// Each sample is registered along with the instance that owns it, so usage
+// can be reported per instance as well as per sample.
+class SampleMemoryBudget final : private juce::Thread
+{
+public:
+    struct SampleUsage
+    {
+        size_t fullBytes = 0;       // the whole sample
+        size_t headBytes = 0;       // the part that always stays in memory
+        size_t hostRateCopyBytes = 0;   // see Sample::makeHostRateCopy()
+        bool resident = false;
+        bool playing = false;
+        juce::uint32 lastPlayed = 0;    // Time::getMillisecondCounter()
+        juce::uint32 numUnderruns = 0;
+    };
+
+    struct Usage
+    {
+        size_t residentBytes = 0;
+        size_t onDiskBytes = 0;
+        juce::uint32 numUnderruns = 0;
+        std::vector<SampleUsage> samples;
+    };
+
+    struct Stats
+    {
+        size_t budgetBytes = 0;     // zero if there's no limit
+        size_t residentBytes = 0;
+        juce::uint32 numDemotions = 0;
+        juce::uint32 numPromotions = 0;
+        juce::uint32 numFailures = 0;   // files that couldn't be written or read
+    };
+
+    SampleMemoryBudget()
+        : juce::Thread("Sampler memory budget")
+    {
+    }
+
+    ~SampleMemoryBudget() override
+    {
+        stopThread(5000);
+    }
+
+    // One budget for the whole process, which stays alive for as long as
+    // anyone holds on to it. Message thread only.
+    static std::shared_ptr<SampleMemoryBudget> getShared()
+    {
+        auto& shared = getSharedState();
+        const std::lock_guard<std::mutex> lock(shared.mutex);
+        auto budget = shared.budget.lock();
+
+        if (budget == nullptr)
+        {
+            budget = std::make_shared<SampleMemoryBudget>();
+            budget->setBudget(shared.budgetBytes);
+            shared.budget = budget;
+        }
+
+        return budget;
+    }
+
+    // Sets the budget of the shared one, now if it exists, and whenever
+    // getShared() makes a new one. Message thread only.
+    static void setSharedBudget(size_t numBytes)
+    {
+        auto& shared = getSharedState();
+        const std::lock_guard<std::mutex> lock(shared.mutex);
+        shared.budgetBytes = numBytes;
+
+        if (auto budget = shared.budget.lock())
+            budget->setBudget(numBytes);
+    }
+
+    // Zero means no limit. Message thread only.
+    void setBudget(size_t numBytes)
+    {
+        budgetBytes.store(numBytes);
+
+        if (numBytes == 0)
+            return;
+
+        if (!isThreadRunning())
+            startThread();
+
+        notify();
+    }
+
+    // Starts keeping track of a sample. It's forgotten about again once
+    // nobody else holds on to it.
+    void addSample(std::weak_ptr<Sample> sample, const void* owner)
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        entries.push_back({ std::move(sample), owner });
+    }
+
+    Usage getUsage(const void* owner) const
+    {
+        Usage usage;
+
+        for (auto& sample : getSamples(owner))
+        {
+            SampleUsage sampleUsage;
+            sampleUsage.fullBytes = sample->getFullBytes();
+            sampleUsage.headBytes = sample->getHeadBytes();
+            sampleUsage.hostRateCopyBytes = sample->getHostRateCopyBytes();
+            sampleUsage.resident = sample->isResident();
+            sampleUsage.playing = sample->isPlaying();
+            sampleUsage.lastPlayed = sample->getLastPlayed();
+            sampleUsage.numUnderruns = sample->getNumUnderruns();
+
+            usage.residentBytes += sample->getBytesInMemory();
+            usage.onDiskBytes += sampleUsage.resident ? 0 : sampleUsage.fullBytes;
+            usage.numUnderruns += sampleUsage.numUnderruns;
+            usage.samples.push_back(sampleUsage);
+        }
+
+        return usage;
+    }
+
+    Stats getStats() const
+    {
+        Stats stats;
+        stats.budgetBytes = budgetBytes.load();
+        stats.numDemotions = demotions.load();
+        stats.numPromotions = promotions.load();
+        stats.numFailures = failures.load();
+
+        for (auto& sample : getSamples(nullptr))
+            stats.residentBytes += sample->getBytesInMemory();
+
+        return stats;
+    }
+
+private:
+    enum { pollIntervalMs = 10 };
+
+    struct SharedState
+    {
+        std::mutex mutex;
+        std::weak_ptr<SampleMemoryBudget> budget;
+        size_t budgetBytes = 0;
+    };
+
+    static SharedState& getSharedState()
+    {
+        static SharedState state;
+        return state;
+    }
+
+    struct Entry
+    {
+        std::weak_ptr<Sample> sample;
+        const void* owner;
+    };
+
+    // Every live sample belonging to owner, or to anyone if owner is null.
+    std::vector<std::shared_ptr<Sample>> getSamples(const void* owner) const
+    {
+        std::vector<std::shared_ptr<Sample>> samples;
+        const std::lock_guard<std::mutex> lock(mutex);
+
+        for (auto& entry : entries)
+            if (owner == nullptr || entry.owner == owner)
+                if (auto sample = entry.sample.lock())
+                    samples.push_back(std::move(sample));
+
+        return samples;
+    }
+
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            // Without a budget nothing new goes out to disk, so once
+            // everything is back there's nothing to do until there's a
+            // budget again.
+            const auto anythingOnDisk = update();
+            wait(budgetBytes.load() == 0 && !anythingOnDisk ? -1 : pollIntervalMs);
+        }
+    }
+
+    // Returns true if any sample still has data on disk.
+    bool update()
+    {
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            entries.erase(std::remove_if(entries.begin(), entries.end(), [](const Entry& entry) { return entry.sample.expired(); }),
+                entries.end());
+        }
+
+        // The disk work happens without holding the lock.
+        auto samples = getSamples(nullptr);
+
+        // Anything that has just started playing comes back first.
+        for (auto& sample : samples)
+        {
+            if (!sample->wantsPromotion())
+                continue;
+
+            const auto wasResident = sample->isResident();
+
+            if (!sample->promote())
+                failures.fetch_add(1);
+            else if (!wasResident)
+                promotions.fetch_add(1);
+        }
+
+        auto anythingOnDisk = std::any_of(samples.begin(), samples.end(), [](auto& sample) { return !sample->isResident(); });
+        const auto budget = budgetBytes.load();
+
+        if (budget == 0)
+            return anythingOnDisk;
+
+        size_t total = 0;
+
+        for (auto& sample : samples)
+            total += sample->getBytesInMemory();
+
+        // Then move out the least recently played samples until everything
+        // fits, skipping any that can't go right now.
+        std::vector<Sample*> skipped;
+
+        while (total > budget)
+        {
+            Sample* oldest = nullptr;
+
+            for (auto& sample : samples)
+            {
+                if (sample->getBytesInMemory() == sample->getHeadBytes() || !sample->canBeDemoted() || sample->isPlaying()
+                    || std::find(skipped.begin(), skipped.end(), sample.get()) != skipped.end())
+                    continue;
+
+                if (oldest == nullptr || sample->getLastPlayed() < oldest->getLastPlayed())
+                    oldest = sample.get();
+            }
+
+            if (oldest == nullptr)
+                break;
+
+            const auto bytesBefore = oldest->getBytesInMemory();
+
+            if (oldest->demote())
+            {
+                total -= bytesBefore - oldest->getBytesInMemory();
+                demotions.fetch_add(1);
+                anythingOnDisk = true;
+            }
+            else
+            {
+                skipped.push_back(oldest);
+            }
+        }
+
+        return anythingOnDisk;
+    }
+
+    mutable std::mutex mutex;
+    std::vector<Entry> entries;
+
+    std::atomic<size_t> budgetBytes{ 0 };
+    std::atomic<juce::uint32> demotions{ 0 };
+    std::atomic<juce::uint32> promotions{ 0 };
+    std::atomic<juce::uint32> failures{ 0 };
+
+    JUCE_DECLARE_NON_COPYABLE(SampleMemoryBudget)
+};
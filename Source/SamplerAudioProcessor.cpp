@@ -21,19 +21,31 @@
 #include "SamplerAudioProcessorEditor.h"
 
 
-SamplerAudioProcessor::SamplerAudioProcessor() 
+SamplerAudioProcessor::SamplerAudioProcessor(int maxNumberOfVoices)
     : AudioProcessor(BusesProperties().withOutput("Output", AudioChannelSet::stereo(), true)),
-    parameters (*this, nullptr, juce::Identifier("SamplerAudioProcessor"), createParameters())
+    parameters (*this, nullptr, juce::Identifier("SamplerAudioProcessor"), createParameters()),
+    maxVoices(jmax(1, maxNumberOfVoices)),
+    voiceTelemetry(new VoiceTelemetry[(size_t)maxVoices])
 {
     parameters.addParameterListener(IDs::centerNote, this);
 
+    // All of the voices we'll ever use are created here, up front.
+    m_numVoices = jmin(m_numVoices, maxVoices);
+    synthesiser.setVoicePool(std::make_unique<VoicePool>(maxVoices, samplerSound, parameters), m_numVoices);
+    bindVoiceTelemetry();
+
     if (auto cello = createAssetInputStream("cello.wav")) {
         setSample(cello.get());
     }
+
+    publishSnapshot();
 }
 
 SamplerAudioProcessor::~SamplerAudioProcessor() {
     parameters.removeParameterListener(IDs::centerNote, this);
+
+    if (offlineSample != nullptr)
+        offlineSample->stoppedPlaying();
 }
 
 float SamplerAudioProcessor::getParameterRaw(int parameterIndex) {
@@ -62,12 +74,18 @@ void SamplerAudioProcessor::parameterChanged(const String& parameterID, float ne
     if (parameterID.equalsIgnoreCase(IDs::centerNote)) {
         float pitchInHz = MidiMessage::getMidiNoteInHertz((int)newValue);
         dataModel.setCentreFrequencyHz(pitchInHz, nullptr);
-        this->samplerSound->setCentreFrequencyInHz(pitchInHz);
+
+        // This may be called from any thread, including the audio thread,
+        // and the sound may be swapped out at any time, so this goes through
+        // the mailbox rather than touching the sound directly.
+        setCentreFrequency(pitchInHz);
     }
 }
 
 void SamplerAudioProcessor::reset() {
     synthesiser.turnOffAllVoices(false);
+    std::get<QuantumRenderer<float>>(quantumRenderers).reset();
+    std::get<QuantumRenderer<double>>(quantumRenderers).reset();
 }
 
 bool SamplerAudioProcessor::setSample(juce::InputStream* inputStream) {
@@ -82,7 +100,7 @@ bool SamplerAudioProcessor::setSample(juce::InputStream* inputStream) {
         return false;
     }
     
-    synthesiser.clearVoices();
+    synthesiser.stopAllVoicesImmediately();
 
     // Set up initial sample, which we load from a binary resource
     AudioFormatManager manager;
@@ -94,16 +112,13 @@ bool SamplerAudioProcessor::setSample(juce::InputStream* inputStream) {
     jassert(reader != nullptr); // Failed to load resource!
 
     auto sound = samplerSound;
-    auto sample = std::unique_ptr<Sample>(new Sample(*reader, 10.0));
-    auto lengthInSeconds = sample->getLength() / sample->getSampleRate();
+    setCurrentSample(std::make_shared<Sample>(*reader, 10.0, sampleLayout));
+    auto lengthInSeconds = currentSample->getLength() / currentSample->getSampleRate();
     sound->setLoopPointsInSeconds({ lengthInSeconds * 0.1, lengthInSeconds * 0.9 });
-    sound->setSample(std::move(sample));
-
-    // Start with the max number of voices
-    for (auto i = 0; i != m_numVoices; ++i) {
-        synthesiser.addVoice(new MPESamplerVoice(sound, this->parameters));
-    }
+    sound->setSample(currentSample);
+    makeHostRateCopy();
 
+    publishSnapshot();
     return true;
     
 }
@@ -130,12 +145,27 @@ AudioProcessorValueTreeState::ParameterLayout SamplerAudioProcessor::createParam
     params.push_back(std::make_unique<AudioParameterFloat>("filterEnvRelease", "Filter Env Release", 0.0f, 3000.0f, 50.0f));
     params.push_back(std::make_unique<AudioParameterFloat>("filterEnvModAmt", "Filter Env Mod Amt", -20000.0f, 20000.0f, 0.0f));
 
+    // These came later. Parameters are also accessed by index, e.g. by
+    // getParameterRaw(), so new ones always go on the end.
+    params.push_back(std::make_unique<AudioParameterChoice>("ampEnvCurve", "Amp Env Curve", StringArray{ "Linear", "Exponential" }, 0));
+    params.push_back(std::make_unique<AudioParameterChoice>("filterEnvCurve", "Filter Env Curve", StringArray{ "Linear", "Exponential" }, 0));
+    params.push_back(std::make_unique<AudioParameterChoice>("filterType", "Filter Type", StringArray{ "Low Pass", "High Pass", "Band Pass", "Notch" }, 0));
+
     return { params.begin(), params.end() };
 }
 
-void SamplerAudioProcessor::prepareToPlay(double sampleRate, int)
+void SamplerAudioProcessor::prepareToPlay(double sampleRate, int samplesPerBlock)
 {
     synthesiser.setCurrentPlaybackSampleRate(sampleRate);
+    midiCoalescer.prepare(sampleRate);
+    governor.prepare(sampleRate);
+
+    const auto numChannels = getTotalNumOutputChannels();
+    std::get<QuantumRenderer<float>>(quantumRenderers).prepare(renderQuantum, samplesPerBlock, numChannels);
+    std::get<QuantumRenderer<double>>(quantumRenderers).prepare(renderQuantum, samplesPerBlock, numChannels);
+    setLatencySamples(std::get<QuantumRenderer<float>>(quantumRenderers).getLatencySamples());
+
+    makeHostRateCopy();
 }
 
 void SamplerAudioProcessor::releaseResources() {}
@@ -149,24 +179,23 @@ bool SamplerAudioProcessor::isBusesLayoutSupported(const BusesLayout& layouts) c
 //==============================================================================
 AudioProcessorEditor* SamplerAudioProcessor::createEditor()
 {
-    // This function will be called from the message thread. We lock the command
-    // queue to ensure that no messages are processed for the duration of this
-    // call.
-    SpinLock::ScopedLockType lock(commandQueueMutex);
+    // This function will be called from the message thread. Rather than
+    // stopping the audio thread from applying commands while we look at the
+    // synthesiser, we read the most recent snapshot that it published.
+    snapshots.update();
+    const auto& snapshot = snapshots.read();
 
     ProcessorState state;
-    state.synthVoices = synthesiser.getNumVoices();
-    state.legacyModeEnabled = synthesiser.isLegacyModeEnabled();
-    state.legacyChannels = synthesiser.getLegacyModeChannelRange();
-    state.legacyPitchbendRange = synthesiser.getLegacyModePitchbendRange();
-    state.voiceStealingEnabled = synthesiser.isVoiceStealingEnabled();
-    state.mpeZoneLayout = synthesiser.getZoneLayout();
+    state.synthVoices = snapshot.synthVoices;
+    state.legacyModeEnabled = snapshot.legacyModeEnabled;
+    state.legacyChannels = snapshot.legacyChannels;
+    state.legacyPitchbendRange = snapshot.legacyPitchbendRange;
+    state.voiceStealingEnabled = snapshot.voiceStealingEnabled;
+    state.mpeZoneLayout = MPEZoneLayout(snapshot.lowerZone, snapshot.upperZone);
     state.readerFactory = readerFactory == nullptr ? nullptr : readerFactory->clone();
-
-    auto sound = samplerSound;
-    state.loopPointsSeconds = sound->getLoopPointsInSeconds();
-    state.centreFrequencyHz = sound->getCentreFrequencyInHz();
-    state.loopMode = sound->getLoopMode();
+    state.loopPointsSeconds = snapshot.loopPointsSeconds;
+    state.centreFrequencyHz = snapshot.centreFrequencyHz;
+    state.loopMode = snapshot.loopMode;
 
     return new SamplerAudioProcessorEditor(*this, std::move(state), this->dataModel, this->formatManager, this->parameters);
 }
@@ -202,6 +231,8 @@ void SamplerAudioProcessor::processBlock(juce::AudioBuffer<double>& buffer, Midi
     process(buffer, midi);
 }
 
+bool SamplerAudioProcessor::supportsDoublePrecisionProcessing() const { return true; }
+
 // These should be called from the GUI thread, and will block until the
 // command buffer has enough room to accept a command.
 void SamplerAudioProcessor::setSample(std::unique_ptr<AudioFormatReaderFactory> fact, AudioFormatManager& formatManager)
@@ -209,72 +240,58 @@ void SamplerAudioProcessor::setSample(std::unique_ptr<AudioFormatReaderFactory>
     class SetSampleCommand
     {
     public:
-        SetSampleCommand(std::unique_ptr<AudioFormatReaderFactory> r,
-            std::unique_ptr<Sample> sampleIn,
-            std::vector<std::unique_ptr<MPESamplerVoice>> newVoicesIn)
-            : readerFactory(std::move(r)),
-            sample(std::move(sampleIn)),
-            newVoices(std::move(newVoicesIn))
+        explicit SetSampleCommand(std::shared_ptr<const Sample> sampleIn)
+            : sample(std::move(sampleIn)),
+            sound(std::make_shared<MPESamplerSound>())
         {}
 
         void operator() (SamplerAudioProcessor& proc)
         {
-            proc.readerFactory = std::move(readerFactory);
-            auto sound = proc.samplerSound;
+            // The new sound carries on with the current settings. The voices
+            // stay where they are, and are just rebound to it.
+            *sound = *proc.samplerSound;
             sound->setSample(std::move(sample));
-            auto numberOfVoices = proc.synthesiser.getNumVoices();
-            proc.synthesiser.clearVoices();
+            std::swap(proc.samplerSound, sound);
+            proc.synthesiser.setSound(proc.samplerSound);
 
-            for (auto it = begin(newVoices); proc.synthesiser.getNumVoices() < numberOfVoices; ++it)
-            {
-                proc.synthesiser.addVoice(it->release());
-            }
+            // The old sound, and its sample, end up back in here, so they're
+            // freed on the message thread along with the command.
         }
 
     private:
-        std::unique_ptr<AudioFormatReaderFactory> readerFactory;
-        std::unique_ptr<Sample> sample;
-        std::vector<std::unique_ptr<MPESamplerVoice>> newVoices;
+        std::shared_ptr<const Sample> sample;
+        std::shared_ptr<MPESamplerSound> sound;
     };
 
     // Note that all allocation happens here, on the main message thread. Then,
     // we transfer ownership across to the audio thread.
-    auto loadedSamplerSound = samplerSound;
-    std::vector<std::unique_ptr<MPESamplerVoice>> newSamplerVoices;
-    newSamplerVoices.reserve(m_numVoices);
-
-    for (auto i = 0; i != m_numVoices; ++i)
-        newSamplerVoices.emplace_back(new MPESamplerVoice(loadedSamplerSound, this->parameters));
-
     if (fact == nullptr)
     {
-        commands.push(SetSampleCommand(std::move(fact),
-            nullptr,
-            std::move(newSamplerVoices)));
+        readerFactory = nullptr;
+        currentSample = nullptr;
+        commands.push(SetSampleCommand(nullptr));
     }
     else if (auto reader = fact->make(formatManager))
     {
-        commands.push(SetSampleCommand(std::move(fact),
-            std::unique_ptr<Sample>(new Sample(*reader, 10.0)),
-            std::move(newSamplerVoices)));
+        readerFactory = std::move(fact);
+        setCurrentSample(std::make_shared<Sample>(*reader, 10.0, sampleLayout));
+        makeHostRateCopy();
+        commands.push(SetSampleCommand(currentSample));
     }
 }
 
 void SamplerAudioProcessor::setSample(std::vector<std::vector<float>> soundData, double sampleRate) {
     
-    synthesiser.clearVoices();
+    synthesiser.stopAllVoicesImmediately();
 
     auto sound = samplerSound;
-    auto sample = std::unique_ptr<Sample>(new Sample(soundData, sampleRate));
-    auto lengthInSeconds = sample->getLength() / sample->getSampleRate();
+    setCurrentSample(std::make_shared<Sample>(soundData, sampleRate, sampleLayout));
+    auto lengthInSeconds = currentSample->getLength() / currentSample->getSampleRate();
     sound->setLoopPointsInSeconds({ lengthInSeconds * 0.1, lengthInSeconds * 0.9 });
-    sound->setSample(std::move(sample));
-
-    // Start with the max number of voices
-    for (auto i = 0; i != m_numVoices; ++i) {
-        synthesiser.addVoice(new MPESamplerVoice(sound, this->parameters));
-    }
+    sound->setSample(currentSample);
+    makeHostRateCopy();
 
+    publishSnapshot();
 }
 
 // Set the sample with an absolute path to a wav file.
@@ -290,32 +307,18 @@ bool SamplerAudioProcessor::setSample(const char* path) {
 
 void SamplerAudioProcessor::setCentreFrequency(double centreFrequency)
 {
-    commands.push([centreFrequency](SamplerAudioProcessor& proc)
-        {
-            auto loaded = proc.samplerSound;
-            if (loaded != nullptr)
-                loaded->setCentreFrequencyInHz(centreFrequency);
-        });
+    centreFrequencyMailbox.store(centreFrequency);
+    centreFrequencyChanged.store(true, std::memory_order_release);
 }
 
 void SamplerAudioProcessor::setLoopMode(LoopMode loopMode)
 {
-    commands.push([loopMode](SamplerAudioProcessor& proc)
-        {
-            auto loaded = proc.samplerSound;
-            if (loaded != nullptr)
-                loaded->setLoopMode(loopMode);
-        });
+    loopModeMailbox.publish(loopMode);
 }
 
 void SamplerAudioProcessor::setLoopPoints(Range<double> loopPoints)
 {
-    commands.push([loopPoints](SamplerAudioProcessor& proc)
-        {
-            auto loaded = proc.samplerSound;
-            if (loaded != nullptr)
-                loaded->setLoopPointsInSeconds(loopPoints);
-        });
+    loopPointsMailbox.publish(loopPoints);
 }
 
 void SamplerAudioProcessor::setMPEZoneLayout(MPEZoneLayout layout)
@@ -346,44 +349,216 @@ void SamplerAudioProcessor::setVoiceStealingEnabled(bool voiceStealingEnabled)
         });
 }
 
-void SamplerAudioProcessor::setNumberOfVoices(int numberOfVoices)
+void SamplerAudioProcessor::setVoiceStealingPolicy(VoiceStealingPolicy policy)
+{
+    commands.push([policy](SamplerAudioProcessor& proc)
+        {
+            proc.synthesiser.setVoiceStealingPolicy(policy);
+        });
+}
+
+juce::uint32 SamplerAudioProcessor::getNumVoiceSteals(VoiceStealingPolicy policy) const
+{
+    return synthesiser.getNumSteals(policy);
+}
+
+void SamplerAudioProcessor::setControllerCoalescingWindow(double seconds)
+{
+    commands.push([seconds](SamplerAudioProcessor& proc)
+        {
+            proc.midiCoalescer.setWindowLength(seconds);
+        });
+}
+
+juce::uint32 SamplerAudioProcessor::getNumCoalescedControllerMessages() const
+{
+    return midiCoalescer.getNumMergedMessages();
+}
+
+void SamplerAudioProcessor::setMinimumSubBlockSize(int numSamples, bool keepNoteOnsExact)
+{
+    numSamples = jmax(1, numSamples);
+
+    commands.push([numSamples, keepNoteOnsExact](SamplerAudioProcessor& proc)
+        {
+            // MPESynthesiser's own minimum handles events early, note-ons
+            // included, so only use it when note-ons don't need to be exact.
+            proc.midiQuantiser.setGranularity(keepNoteOnsExact ? numSamples : 0);
+            proc.synthesiser.setMinimumRenderingSubdivisionSize(keepNoteOnsExact ? 1 : numSamples);
+        });
+}
+
+void SamplerAudioProcessor::setRenderQuantum(int numSamples)
+{
+    renderQuantum = jmax(0, numSamples);
+}
+
+int SamplerAudioProcessor::getRenderQuantum() const { return renderQuantum; }
+
+void SamplerAudioProcessor::setCpuGovernorEnabled(bool shouldBeEnabled)
+{
+    commands.push([shouldBeEnabled](SamplerAudioProcessor& proc)
+        {
+            proc.governor.setEnabled(shouldBeEnabled);
+        });
+}
+
+CpuGovernor::Stats SamplerAudioProcessor::getCpuGovernorStats() const
+{
+    auto stats = governor.getStats();
+    stats.numEarlyCulls = synthesiser.getNumEarlyCulls();
+    return stats;
+}
+
+void SamplerAudioProcessor::setSilenceDetection(float thresholdDecibels, double holdSeconds)
+{
+    const auto thresholdGain = juce::Decibels::decibelsToGain(thresholdDecibels);
+
+    commands.push([thresholdGain, holdSeconds](SamplerAudioProcessor& proc)
+        {
+            proc.synthesiser.setSilenceDetection(thresholdGain, holdSeconds);
+        });
+}
+
+juce::uint32 SamplerAudioProcessor::getNumSilentVoicesCulled() const
+{
+    return synthesiser.getNumSilentCulls();
+}
+
+juce::uint32 SamplerAudioProcessor::getNumIdleBlocks() const { return idleBlocks.load(std::memory_order_relaxed); }
+
+void SamplerAudioProcessor::setSampleLayout(SampleLayout layout)
+{
+    sampleLayout = layout;
+}
+
+SampleMemoryStats SamplerAudioProcessor::getSampleMemoryStats() const
+{
+    return SampleAllocator::getStats();
+}
+
+void SamplerAudioProcessor::setSampleMemoryBudget(size_t numBytes)
+{
+    SampleMemoryBudget::setSharedBudget(numBytes);
+}
+
+void SamplerAudioProcessor::updateOfflineHold(bool realtime)
 {
-    // We don't want to call 'new' on the audio thread. Normally, we'd
-    // construct things here, on the GUI thread, and then move them into the
-    // command lambda. Unfortunately, C++11 doesn't have extended lambda
-    // capture, so we use a custom struct instead.
+    const auto* wanted = realtime ? nullptr : samplerSound->getSample();
 
-    class SetNumVoicesCommand
+    if (wanted != offlineSample.get())
+    {
+        // Take the new hold before letting go of the old one, in case they're
+        // the same data.
+        if (wanted != nullptr)
+            wanted->startedPlaying();
+
+        if (offlineSample != nullptr)
+            offlineSample->stoppedPlaying();
+
+        offlineSample = realtime ? nullptr : samplerSound->getSharedSample();
+    }
+
+    if (offlineSample != nullptr)
+        offlineSample->promote();
+}
+
+SampleMemoryBudget::Usage SamplerAudioProcessor::getSampleMemoryUsage() const
+{
+    return memoryBudget->getUsage(this);
+}
+
+SampleMemoryBudget::Stats SamplerAudioProcessor::getSampleMemoryBudgetStats() const
+{
+    return memoryBudget->getStats();
+}
+
+void SamplerAudioProcessor::setCurrentSample(std::shared_ptr<Sample> sample)
+{
+    memoryBudget->addSample(sample, this);
+    currentSample = std::move(sample);
+}
+
+void SamplerAudioProcessor::setHostRateResamplingEnabled(bool shouldBeEnabled)
+{
+    hostRateResampling = shouldBeEnabled;
+    makeHostRateCopy();
+}
+
+void SamplerAudioProcessor::makeHostRateCopy()
+{
+    const auto hostSampleRate = getSampleRate();
+
+    if (!hostRateResampling || currentSample == nullptr || hostSampleRate <= 0.0)
+        return;
+
+    // The job keeps the sample alive until it's done with it. Voices pick up
+    // the copy by themselves once it's there.
+    backgroundThreads.addJob([sample = currentSample, hostSampleRate]
+        {
+            sample->makeHostRateCopy(hostSampleRate);
+        });
+}
+
+void SamplerAudioProcessor::setNumRenderThreads(int numWorkers)
+{
+    setRenderThreadPool(numWorkers > 0 ? std::make_shared<RenderThreadPool>(numWorkers) : nullptr);
+}
+
+void SamplerAudioProcessor::useSharedRenderThreads()
+{
+    setRenderThreadPool(RenderThreadPool::getShared());
+}
+
+void SamplerAudioProcessor::setRenderThreadPool(std::shared_ptr<RenderThreadPool> pool)
+{
+    class SetRenderThreadsCommand
     {
     public:
-        SetNumVoicesCommand(std::vector<std::unique_ptr<MPESamplerVoice>> newVoicesIn)
-            : newVoices(std::move(newVoicesIn))
+        SetRenderThreadsCommand(std::shared_ptr<RenderThreadPool> poolIn,
+            std::unique_ptr<SamplerSynthesiser::VoiceRenderer> rendererIn)
+            : pool(std::move(poolIn)),
+            renderer(std::move(rendererIn))
         {}
 
         void operator() (SamplerAudioProcessor& proc)
         {
-            if ((int)newVoices.size() < proc.synthesiser.getNumVoices())
-                proc.synthesiser.reduceNumVoices(int(newVoices.size()));
-            else
-                for (auto it = begin(newVoices); (size_t)proc.synthesiser.getNumVoices() < newVoices.size(); ++it)
-                    proc.synthesiser.addVoice(it->release());
+            // The old pool and renderer end up back in here, so they are
+            // destroyed on the message thread along with the command.
+            renderer = proc.synthesiser.setParallelRenderer(std::move(renderer));
+            std::swap(proc.renderThreadPool, pool);
         }
 
     private:
-        std::vector<std::unique_ptr<MPESamplerVoice>> newVoices;
+        // The renderer refers to the pool, so it must be destroyed first.
+        std::shared_ptr<RenderThreadPool> pool;
+        std::unique_ptr<SamplerSynthesiser::VoiceRenderer> renderer;
     };
 
-    m_numVoices = min((int)maxVoices, numberOfVoices);
-    auto loadedSamplerSound = samplerSound;
-    std::vector<std::unique_ptr<MPESamplerVoice>> newSamplerVoices;
-    newSamplerVoices.reserve((size_t)m_numVoices);
+    // Starting threads and allocating scratch space both happen here.
+    std::unique_ptr<SamplerSynthesiser::VoiceRenderer> renderer;
 
-    for (auto i = 0; i != m_numVoices; ++i)
-        newSamplerVoices.emplace_back(new MPESamplerVoice(loadedSamplerSound, this->parameters));
+    if (pool != nullptr)
+        renderer = std::make_unique<SamplerSynthesiser::VoiceRenderer>(*pool, maxVoices, SamplerSynthesiser::renderSliceLength);
 
-    commands.push(SetNumVoicesCommand(std::move(newSamplerVoices)));
+    commands.push(SetRenderThreadsCommand(std::move(pool), std::move(renderer)));
 }
 
+void SamplerAudioProcessor::setNumberOfVoices(int numberOfVoices)
+{
+    // Every voice already exists in the synthesiser's pool, so changing the
+    // polyphony just enables or disables some of them. Nothing is created or
+    // destroyed on either thread.
+    m_numVoices = jlimit(0, maxVoices, numberOfVoices);
+
+    commands.push([numVoices = m_numVoices](SamplerAudioProcessor& proc)
+        {
+            proc.synthesiser.setNumVoices(numVoices);
+        });
+}
+
+int SamplerAudioProcessor::getMaxNumVoices() const { return maxVoices; }
+
 // These accessors are just for an 'overview' and won't give the exact
 // state of the audio engine at a particular point in time.
 // If you call getNumVoices(), get the result '10', and then call
@@ -391,41 +566,118 @@ void SamplerAudioProcessor::setNumberOfVoices(int numberOfVoices)
 // been updated to remove some voices in the meantime, so the returned
 // value won't correspond to an existing voice.
 int SamplerAudioProcessor::getNumVoices() const { return synthesiser.getNumVoices(); }
-float SamplerAudioProcessor::getPlaybackPosition(int voice) const { return playbackPositions.at((size_t)voice); }
+float SamplerAudioProcessor::getPlaybackPosition(int voice) const { return getVoiceTelemetry(voice).positionSeconds; }
 
-//==============================================================================
-template <typename Element>
-void SamplerAudioProcessor::process(juce::AudioBuffer<Element>& buffer, MidiBuffer& midiMessages)
+VoiceTelemetry::Snapshot SamplerAudioProcessor::getVoiceTelemetry(int voice) const
 {
-    // Try to acquire a lock on the command queue.
-    // If we were successful, we pop all pending commands off the queue and
-    // apply them to the processor.
-    // If we weren't able to acquire the lock, it's because someone called
-    // createEditor, which requires that the processor data model stays in
-    // a valid state for the duration of the call.
-    const GenericScopedTryLock<SpinLock> lock(commandQueueMutex);
+    jassert(juce::isPositiveAndBelow(voice, maxVoices));
+    return voiceTelemetry[(size_t)voice].read();
+}
 
-    if (lock.isLocked())
-        commands.call(*this);
+void SamplerAudioProcessor::bindVoiceTelemetry()
+{
+    // Voices and telemetry records are paired by their index in the pool.
+    auto& pool = synthesiser.getVoicePool();
 
-    synthesiser.renderNextBlock(buffer, midiMessages, 0, buffer.getNumSamples());
+    for (auto i = 0; i < pool.getCapacity(); ++i)
+        pool.getVoice(i)->setTelemetry(&voiceTelemetry[(size_t)i]);
+}
 
-    auto loadedSamplerSound = samplerSound;
+void SamplerAudioProcessor::publishSnapshot()
+{
+    auto& snapshot = snapshots.getWriteBuffer();
+    snapshot.version = ++snapshotVersion;
+    snapshot.synthVoices = synthesiser.getNumVoices();
+    snapshot.legacyModeEnabled = synthesiser.isLegacyModeEnabled();
+    snapshot.legacyChannels = synthesiser.getLegacyModeChannelRange();
+    snapshot.legacyPitchbendRange = synthesiser.getLegacyModePitchbendRange();
+    snapshot.voiceStealingEnabled = synthesiser.isVoiceStealingEnabled();
+    snapshot.lowerZone = publishedLowerZone = synthesiser.getLowerZone();
+    snapshot.upperZone = publishedUpperZone = synthesiser.getUpperZone();
 
-    if (loadedSamplerSound->getSample() == nullptr)
-        return;
+    auto sound = samplerSound;
+    snapshot.loopPointsSeconds = sound->getLoopPointsInSeconds();
+    snapshot.centreFrequencyHz = sound->getCentreFrequencyInHz();
+    snapshot.loopMode = sound->getLoopMode();
 
-    auto numVoices = synthesiser.getNumVoices();
+    snapshots.publish();
+}
 
-    // Update the current playback positions
-    for (auto i = 0; i < maxVoices; ++i)
+bool SamplerAudioProcessor::applySoundMailboxes()
+{
+    auto loaded = samplerSound;
+    auto changed = false;
+
+    if (centreFrequencyChanged.exchange(false, std::memory_order_acquire))
     {
-        auto* voicePtr = dynamic_cast<MPESamplerVoice*> (synthesiser.getVoice(i));
+        loaded->setCentreFrequencyInHz(centreFrequencyMailbox.load());
+        changed = true;
+    }
 
-        if (i < numVoices && voicePtr != nullptr)
-            playbackPositions[(size_t)i] = static_cast<float> (voicePtr->getCurrentSamplePosition() / loadedSamplerSound->getSample()->getSampleRate());
-        else
-            playbackPositions[(size_t)i] = 0.0f;
+    LoopMode loopMode;
+    if (loopModeMailbox.pull(loopMode))
+    {
+        loaded->setLoopMode(loopMode);
+        changed = true;
     }
 
+    Range<double> loopPoints;
+    if (loopPointsMailbox.pull(loopPoints))
+    {
+        loaded->setLoopPointsInSeconds(loopPoints);
+        changed = true;
+    }
+
+    return changed;
+}
+
+//==============================================================================
+template <typename Element>
+void SamplerAudioProcessor::process(juce::AudioBuffer<Element>& buffer, MidiBuffer& midiMessages)
+{
+    // Pop all pending commands off the queue and apply them to the processor,
+    // then pick up the latest continuous edits. Commands go first so that loop
+    // points are constrained against any newly loaded sample.
+    // If anything changed, let the message thread know about the new state.
+    auto changed = commands.call(*this) > 0;
+    changed = applySoundMailboxes() || changed;
+
+    if (changed)
+        publishSnapshot();
+
+    auto& renderer = std::get<QuantumRenderer<Element>>(quantumRenderers);
+
+    // There's no deadline to meet when rendering offline.
+    const auto realtime = !isNonRealtime();
+    updateOfflineHold(realtime);
+
+    // With nothing playing and nothing to start, the whole block is silence.
+    // Clearing the buffer is all the work there is, and it leaves the buffer
+    // flagged as cleared for the host.
+    if (midiMessages.isEmpty() && !synthesiser.hasActiveVoices() && renderer.isSilent())
+    {
+        buffer.clear();
+        renderer.advanceSilently(buffer.getNumSamples());
+        idleBlocks.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    const auto renderStart = juce::Time::getHighResolutionTicks();
+    synthesiser.setRenderQuality(realtime ? governor.getQuality() : RenderQuality::full);
+
+    midiCoalescer.process(midiMessages);
+    midiQuantiser.process(midiMessages);
+
+    renderer.process(buffer, midiMessages,
+        [this](juce::AudioBuffer<Element>& output, const MidiBuffer& midi, int startSample, int numSamples)
+        {
+            synthesiser.renderNextBlock(output, midi, startSample, numSamples);
+        });
+
+    // MPE configuration messages in the MIDI can change the zones too.
+    if (synthesiser.getLowerZone() != publishedLowerZone || synthesiser.getUpperZone() != publishedUpperZone)
+        publishSnapshot();
+
+    if (realtime)
+        governor.blockRendered(juce::Time::getHighResolutionTicks() - renderStart, buffer.getNumSamples());
 }
@@ -22,17 +22,27 @@
 #include "Misc.h"
 #include "MemoryAudioFormatReaderFactory.h"
 #include "Sample.h"
+#include "SampleMemoryBudget.h"
 #include "DataModels/DataModel.h"
 #include "MPESamplerSound.h"
 #include "MPESamplerVoice.h"
+#include "SamplerSynthesiser.h"
 #include "CommandFifo.h"
+#include "TripleBuffer.h"
+#include "MidiCoalescer.h"
+#include "MidiEventQuantiser.h"
+#include "QuantumRenderer.h"
+#include "CpuGovernor.h"
+#include "ProcessorState.h"
 
 
 class SamplerAudioProcessor final : public AudioProcessor, public AudioProcessorValueTreeState::Listener
 {
 
 public:
-    SamplerAudioProcessor();
+    // The voice pool is allocated once, up front, with room for
+    // maxNumberOfVoices voices. setNumberOfVoices can go up to that limit.
+    explicit SamplerAudioProcessor(int maxNumberOfVoices = 256);
 
     ~SamplerAudioProcessor();
 
@@ -70,6 +80,10 @@ public:
 
     void processBlock(juce::AudioBuffer<double>& buffer, MidiBuffer& midi) override;
 
+    // The voices render natively at double precision, rather than rendering
+    // in float and converting.
+    bool supportsDoublePrecisionProcessing() const override;
+
     // These should be called from the GUI thread, and will block until the
     // command buffer has enough room to accept a command.
     void setSample(std::unique_ptr<AudioFormatReaderFactory> fact, AudioFormatManager& formatManager);
@@ -84,6 +98,7 @@ public:
 
     void setParameterRawNotifyingHost(int parameterIndex, float newValue);
 
+    // Safe to call from any thread.
     void setCentreFrequency(double centreFrequency);
 
     void setLoopMode(LoopMode loopMode);
@@ -96,8 +111,95 @@ public:
 
     void setVoiceStealingEnabled(bool voiceStealingEnabled);
 
+    void setVoiceStealingPolicy(VoiceStealingPolicy policy);
+
+    // How many notes have taken a voice from another note under each policy.
+    juce::uint32 getNumVoiceSteals(VoiceStealingPolicy policy) const;
+
+    // Merges pitchbend, pressure and timbre messages on the same channel that
+    // arrive within 'seconds' of each other in a block, keeping only the
+    // latest. Zero turns merging off.
+    void setControllerCoalescingWindow(double seconds);
+
+    juce::uint32 getNumCoalescedControllerMessages() const;
+
+    // Stops MIDI events from splitting the render into sub-blocks shorter
+    // than numSamples. If keepNoteOnsExact is true, note-ons still start on
+    // the exact sample they were sent, and everything else is moved onto a
+    // numSamples grid instead.
+    void setMinimumSubBlockSize(int numSamples, bool keepNoteOnsExact);
+
+    // The synthesiser always renders in pieces of this many samples, whatever
+    // the host's block size. There's no added latency as long as the host's
+    // maximum block size is a multiple of the quantum, and one quantum of
+    // latency otherwise. Zero renders whole host blocks. Takes effect the next
+    // time prepareToPlay is called.
+    void setRenderQuantum(int numSamples);
+    int getRenderQuantum() const;
+
+    // Spreads voice rendering over this many extra real-time threads, on top
+    // of the host's audio thread. The output is the same as with no workers,
+    // bit for bit. Zero renders everything on the host's thread.
+    void setNumRenderThreads(int numWorkers);
+
+    // Renders voices with one set of worker threads shared by every instance
+    // in the process, sized to the machine, instead of threads of our own.
+    // Handy when a host runs many instances, since it saves starting a set
+    // of threads for each one. Instances the host calls one after another
+    // take turns with the workers; their voices aren't batched together.
+    void useSharedRenderThreads();
+
+    // When enabled, rendering quality on released notes is lowered step by
+    // step if blocks start taking too long to render, and restored once
+    // there's headroom again. Offline renders always use full quality.
+    void setCpuGovernorEnabled(bool shouldBeEnabled);
+    CpuGovernor::Stats getCpuGovernorStats() const;
+
+    // Released notes that stay below thresholdDecibels for holdSeconds are
+    // stopped to free their voices. A hold time of zero turns this off, and
+    // it's off until this is called.
+    void setSilenceDetection(float thresholdDecibels, double holdSeconds);
+    juce::uint32 getNumSilentVoicesCulled() const;
+
+    // How the data of samples loaded from now on is laid out in memory.
+    // Interleaved keeps each stereo frame together, which can be kinder to
+    // the cache when lots of voices are reading from lots of samples.
+    void setSampleLayout(SampleLayout layout);
+
+    // How much memory sample data is using across the whole process, broken
+    // down by the kind of page it was allocated from.
+    SampleMemoryStats getSampleMemoryStats() const;
+
+    // Limits how much memory sample data can use across every instance in
+    // the process, zero meaning no limit. Past the limit, the samples that
+    // were played least recently are moved out to disk, apart from their
+    // first half second, which is enough to start a note while the rest is
+    // read back in. Host-rate copies count towards the limit too. Samples
+    // that are playing always stay in memory, and offline renders wait for
+    // the data rather than playing past the head without it.
+    // The limit lasts for the life of the process, so it can be set before
+    // any instances exist, and stays set after they've all gone.
+    static void setSampleMemoryBudget(size_t numBytes);
+
+    // What this instance's samples are using, in total and one by one.
+    SampleMemoryBudget::Usage getSampleMemoryUsage() const;
+
+    // How the budget is doing across the whole process.
+    SampleMemoryBudget::Stats getSampleMemoryBudgetStats() const;
+
+    // When enabled, each sample is also resampled to exactly the host's rate
+    // on a background thread, whenever it's loaded or the rate changes. Notes
+    // played at the centre frequency, or a whole-number multiple of it, then
+    // copy the sample straight out instead of interpolating.
+    void setHostRateResamplingEnabled(bool shouldBeEnabled);
+
+    // How many blocks were skipped because nothing was playing.
+    juce::uint32 getNumIdleBlocks() const;
+
     void setNumberOfVoices(int numberOfVoices);
 
+    int getMaxNumVoices() const;
+
     // These accessors are just for an 'overview' and won't give the exact
     // state of the audio engine at a particular point in time.
     // If you call getNumVoices(), get the result '10', and then call
@@ -106,6 +208,7 @@ public:
     // value won't correspond to an existing voice.
     int getNumVoices() const;
     float getPlaybackPosition(int voice) const;
+    VoiceTelemetry::Snapshot getVoiceTelemetry(int voice) const;
 
     void parameterChanged(const String& parameterID, float newValue) override;
     void reset() override;
@@ -117,11 +220,78 @@ private:
 
     bool setSample(juce::InputStream* inputStream);
 
+    void setRenderThreadPool(std::shared_ptr<RenderThreadPool> pool);
+
+    // Starts resampling currentSample to the host's rate in the background,
+    // if that's enabled. Message thread only.
+    void makeHostRateCopy();
+
+    // Makes sample the current one and hands it to the memory budget.
+    // Message thread only.
+    void setCurrentSample(std::shared_ptr<Sample> sample);
+
+    // A note that runs on past the head of a sample whose data is on disk
+    // plays silence until the rest has been read back in. Offline, that
+    // silence would end up in the render, so the data is read in on the audio
+    // thread instead, and held in memory from one block to the next, so that
+    // the budget can't move it out again in between. It's let go by the first
+    // real-time block after the render. Audio thread only.
+    void updateOfflineHold(bool realtime);
+
+    // Copies the audio thread's view of the processor into the triple buffer.
+    // Must only be called from whichever thread is applying commands.
+    void publishSnapshot();
+
+    // Applies the newest value from each of the sound mailboxes. Returns true
+    // if anything changed.
+    bool applySoundMailboxes();
+
+    // Gives each voice in the pool its own telemetry record.
+    void bindVoiceTelemetry();
+
     CommandFifo<SamplerAudioProcessor> commands;
 
+    // Loop points, loop mode and centre frequency are edited continuously from
+    // the GUI (e.g. while dragging a loop marker), so they skip the command
+    // queue. Each one has a mailbox where only the latest value survives, so
+    // the audio thread does a bounded amount of work however fast they change.
+    TripleBuffer<Range<double>> loopPointsMailbox;
+    TripleBuffer<LoopMode> loopModeMailbox;
+
+    // A triple buffer only allows one writer, but the centre frequency is
+    // also set by the centerNote parameter, from whichever thread changes it.
+    // It fits in an atomic, so any number of threads can write it.
+    std::atomic<double> centreFrequencyMailbox{ 0.0 };
+    std::atomic<bool> centreFrequencyChanged{ false };
+
+    // Only ever touched on the message thread. The audio thread never needs
+    // the factory itself, only the Sample which is built from it.
     std::unique_ptr<AudioFormatReaderFactory> readerFactory;
     std::shared_ptr<MPESamplerSound> samplerSound = std::make_shared<MPESamplerSound>();
-    MPESynthesiser synthesiser;
+
+    // The sample most recently handed to the audio thread. Kept here so the
+    // message thread never has to look at the sound.
+    std::shared_ptr<const Sample> currentSample;
+    bool hostRateResampling = false;
+    SampleLayout sampleLayout = SampleLayout::planar;
+    juce::ThreadPool backgroundThreads{ 1 };
+    std::shared_ptr<SampleMemoryBudget> memoryBudget = SampleMemoryBudget::getShared();
+    std::shared_ptr<const Sample> offlineSample;    // see updateOfflineHold()
+
+    // Must outlive the synthesiser, which may be rendering with it. This may
+    // be the process-wide pool, so it's shared.
+    std::shared_ptr<RenderThreadPool> renderThreadPool;
+    SamplerSynthesiser synthesiser;
+    MidiCoalescer midiCoalescer;
+    MidiEventQuantiser midiQuantiser;
+
+    // Only changed on the message thread, and only read in prepareToPlay.
+    int renderQuantum = 64;
+    std::tuple<QuantumRenderer<float>, QuantumRenderer<double>> quantumRenderers;
+
+    std::atomic<juce::uint32> idleBlocks{ 0 };
+
+    CpuGovernor governor;
 
     AudioFormatManager formatManager;
     DataModel dataModel{ formatManager };
@@ -129,17 +299,24 @@ private:
     AudioProcessorValueTreeState parameters;
     AudioProcessorValueTreeState::ParameterLayout createParameters();
 
-    // This mutex is used to ensure we don't modify the processor state during
-    // a call to createEditor, which would cause the UI to become desynched
-    // with the real state of the processor.
-    SpinLock commandQueueMutex;
+    // The audio thread publishes a snapshot of its state here after applying
+    // each batch of commands. createEditor reads the newest snapshot, so
+    // opening the editor never holds up command delivery.
+    TripleBuffer<ProcessorSnapshot> snapshots;
+    juce::uint32 snapshotVersion = 0;
+
+    // The zones in the latest snapshot, so the audio thread can tell when MPE
+    // configuration messages have changed them.
+    juce::MPEZone publishedLowerZone{ juce::MPEZone::Type::lower };
+    juce::MPEZone publishedUpperZone{ juce::MPEZone::Type::upper };
 
-    enum { maxVoices = 30 };
+    const int maxVoices;
     int m_numVoices = 20;  // never let m_numVoices go above maxVoices;
 
-    // This is used for visualising the current playback position of each voice.
-    // It stores values in seconds units.
-    std::array<std::atomic<float>, maxVoices> playbackPositions;
+    // This is used for visualising the current state of each voice.
+    // The voices write to these directly, so the processor doesn't need to
+    // visit every voice after each block.
+    std::unique_ptr<VoiceTelemetry[]> voiceTelemetry;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SamplerAudioProcessor)
 };
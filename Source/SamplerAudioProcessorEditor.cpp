@@ -31,7 +31,12 @@ SamplerAudioProcessorEditor::SamplerAudioProcessorEditor(SamplerAudioProcessor&
             ret.reserve((size_t)voices);
 
             for (auto i = 0; i != voices; ++i)
-                ret.emplace_back(p.getPlaybackPosition(i));
+            {
+                auto telemetry = p.getVoiceTelemetry(i);
+
+                if (telemetry.active)
+                    ret.emplace_back(telemetry.positionSeconds);
+            }
 
             return ret;
         },
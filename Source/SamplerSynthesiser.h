@@ -0,0 +1,543 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "VoicePool.h"
+#include "VoiceStealer.h"
+#include "ParallelVoiceRenderer.h"
+
+//==============================================================================
+// An MPESynthesiser whose voices all live in a VoicePool.
+// The first getNumVoices() voices of the pool are enabled; the rest sit idle
+// until the polyphony is raised. Enabled voices are kept in two lists: the
+// ones that may be sounding, and the ones that are free. Rendering and voice
+// allocation only ever look at those lists, so their cost follows the number
+// of sounding voices rather than the configured polyphony.
+// Sounding voices are also indexed by note ID, so that once MPEInstrument
+// has found the notes a per-note MPE message applies to, each one goes
+// straight to its voice instead of searching through all of them. The
+// instrument itself still looks through every note it tracks to find the
+// ones on the message's channel, so the cost of a message still grows with
+// the number of sounding notes, just more slowly than it did.
+// When every voice is busy, the VoiceStealer picks a victim according to the
+// chosen policy without scanning, and the victim fades out over a few
+// milliseconds instead of being cut off.
+// Voices can optionally be spread over a RenderThreadPool. Either way they
+// render in slices of at most renderSliceLength samples, so both paths read
+// parameters at the same points and produce the same output.
+class SamplerSynthesiser final : public MPESynthesiser
+{
+public:
+    using VoiceRenderer = ParallelVoiceRenderer<MPESamplerVoice>;
+
+    enum { renderSliceLength = 128 };
+
+    SamplerSynthesiser()
+        : trackedZoneLayout(getZoneLayout())
+    {
+    }
+
+    ~SamplerSynthesiser() override
+    {
+        // The pool owns the voices, not us.
+        voices.clear(false);
+    }
+
+    // Message thread only, before any audio is processed. All of the pool's
+    // voices are enabled once here so that MPESynthesiser sizes its internal
+    // arrays for the whole pool, and won't need to allocate later on.
+    void setVoicePool(std::unique_ptr<VoicePool> newPool, int numVoices)
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        voices.clear(false);
+        pool = std::move(newPool);
+
+        const auto capacity = (size_t)pool->getCapacity();
+        voices.ensureStorageAllocated((int)capacity);
+        activeVoices.reserve(capacity);
+        freeVoices.reserve(capacity);
+        activeVoices.clear();
+        freeVoices.clear();
+
+        noteIndexHeads.fill(-1);
+        noteIndexLinks.assign(capacity, {});
+        stealer.prepare((int)capacity);
+
+        for (auto i = 0; i != pool->getCapacity(); ++i)
+            addVoice(pool->getVoice(i));
+
+        voices.removeLast(voices.size(), false);
+        setNumVoices(numVoices);
+    }
+
+    int getMaxNumVoices() const noexcept
+    {
+        return pool == nullptr ? 0 : pool->getCapacity();
+    }
+
+    const VoicePool& getVoicePool() const noexcept
+    {
+        return *pool;
+    }
+
+    MPESamplerVoice* getSamplerVoice(int index) const
+    {
+        return static_cast<MPESamplerVoice*> (voices[index]);
+    }
+
+    // Changes the polyphony without creating or destroying any voices.
+    // Voices that are disabled while playing are silenced immediately.
+    void setNumVoices(int newNumVoices)
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        newNumVoices = juce::jlimit(0, getMaxNumVoices(), newNumVoices);
+        const auto oldNumVoices = voices.size();
+
+        for (auto i = oldNumVoices; i < newNumVoices; ++i)
+        {
+            auto* voice = pool->getVoice(i);
+            voices.add(voice);
+            freeVoices.push_back(voice);
+        }
+
+        if (newNumVoices < oldNumVoices)
+        {
+            auto isDisabled = [this, newNumVoices](MPESamplerVoice* v) { return pool->indexOf(v) >= newNumVoices; };
+
+            for (auto i = newNumVoices; i < oldNumVoices; ++i)
+            {
+                pool->getVoice(i)->stopImmediately();
+                stealer.voiceStopped(i);
+            }
+
+            activeVoices.erase(std::remove_if(activeVoices.begin(), activeVoices.end(), isDisabled), activeVoices.end());
+            freeVoices.erase(std::remove_if(freeVoices.begin(), freeVoices.end(), isDisabled), freeVoices.end());
+            voices.removeLast(oldNumVoices - newNumVoices, false);
+        }
+    }
+
+    // Stops everything, and rebinds every voice in the pool, playing or not,
+    // to a new sound. Nothing is allocated or freed, as long as someone else
+    // still holds the old sound.
+    void setSound(std::shared_ptr<const MPESamplerSound> sound)
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        stopAllVoicesImmediately();
+
+        for (auto i = 0; i < pool->getCapacity(); ++i)
+            pool->getVoice(i)->reset(sound);
+    }
+
+    // Silences every voice at once, e.g. because the sample data is about to
+    // change underneath them.
+    void stopAllVoicesImmediately()
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        for (auto* voice : activeVoices)
+        {
+            voice->stopImmediately();
+            stealer.voiceStopped(pool->indexOf(voice));
+            freeVoices.push_back(voice);
+        }
+
+        activeVoices.clear();
+    }
+
+    // Voices that have just finished are only noticed by the next render, so
+    // this may stay true for one block longer than strictly necessary.
+    bool hasActiveVoices() const noexcept
+    {
+        return !activeVoices.empty();
+    }
+
+    void setVoiceStealingPolicy(VoiceStealingPolicy policy)
+    {
+        const juce::ScopedLock sl(voicesLock);
+        stealer.setPolicy(policy);
+    }
+
+    VoiceStealingPolicy getVoiceStealingPolicy() const noexcept
+    {
+        return stealer.getPolicy();
+    }
+
+    // Safe to call from any thread.
+    juce::uint32 getNumSteals(VoiceStealingPolicy policy) const noexcept
+    {
+        return stealer.getNumSteals(policy);
+    }
+
+    void setCurrentPlaybackSampleRate(double newRate) override
+    {
+        MPESynthesiser::setCurrentPlaybackSampleRate(newRate);
+
+        // The base class only knows about the enabled voices.
+        const juce::ScopedLock sl(voicesLock);
+
+        for (auto i = voices.size(); i < getMaxNumVoices(); ++i)
+            pool->getVoice(i)->setCurrentSampleRate(newRate);
+    }
+
+    // These hide the base class versions so that the zones we keep track of
+    // follow along. Audio thread only.
+    void setZoneLayout(MPEZoneLayout newLayout)
+    {
+        MPESynthesiser::setZoneLayout(newLayout);
+        trackedZoneLayout = newLayout;
+    }
+
+    void enableLegacyMode(int pitchbendRange, juce::Range<int> channelRange)
+    {
+        // Enabling legacy mode clears the zone layout.
+        MPESynthesiser::enableLegacyMode(pitchbendRange, channelRange);
+        trackedZoneLayout.clearAllZones();
+    }
+
+    // The zones as they are now, including any changes made by MPE
+    // configuration messages in the MIDI. getZoneLayout() hands out a copy,
+    // which may allocate, so use these on the audio thread.
+    juce::MPEZone getLowerZone() const noexcept { return trackedZoneLayout.getLowerZone(); }
+    juce::MPEZone getUpperZone() const noexcept { return trackedZoneLayout.getUpperZone(); }
+
+    // Applied to every voice before each render.
+    void setRenderQuality(RenderQuality newQuality) noexcept
+    {
+        renderQuality = newQuality;
+    }
+
+    // How many released voices were stopped early because of the render
+    // quality. Safe to call from any thread.
+    juce::uint32 getNumEarlyCulls() const noexcept
+    {
+        return earlyCulls.load(std::memory_order_relaxed);
+    }
+
+    // Applies to every voice in the pool, enabled or not.
+    void setSilenceDetection(float thresholdGain, double holdSeconds)
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        for (auto i = 0; i < getMaxNumVoices(); ++i)
+            pool->getVoice(i)->setSilenceDetection(thresholdGain, holdSeconds);
+    }
+
+    // How many released voices were stopped because they had gone silent.
+    // Safe to call from any thread.
+    juce::uint32 getNumSilentCulls() const noexcept
+    {
+        return silentCulls.load(std::memory_order_relaxed);
+    }
+
+    // Hands voice rendering over to a set of worker threads, or back to the
+    // calling thread if newRenderer is null. Returns the previous renderer so
+    // that it can be destroyed away from the audio thread.
+    std::unique_ptr<VoiceRenderer> setParallelRenderer(std::unique_ptr<VoiceRenderer> newRenderer)
+    {
+        const juce::ScopedLock sl(voicesLock);
+        std::swap(parallelRenderer, newRenderer);
+        return newRenderer;
+    }
+
+    // These would delete voices that belong to the pool.
+    void clearVoices() = delete;
+    void removeVoice(int) = delete;
+    void reduceNumVoices(int) = delete;
+
+protected:
+    // The instrument's layout picks up MPE configuration messages from here,
+    // so ours sees exactly the same ones.
+    void handleMidiEvent(const juce::MidiMessage& message) override
+    {
+        MPESynthesiser::handleMidiEvent(message);
+        trackedZoneLayout.processNextMidiEvent(message);
+    }
+
+    void noteAdded(MPENote newNote) override
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        if (auto* voice = takeFreeVoice())
+        {
+            activeVoices.push_back(voice);
+            startVoice(voice, newNote);
+            indexVoice(voice, newNote);
+            stealer.voiceStarted(pool->indexOf(voice), newNote.initialNote);
+        }
+        else if (isVoiceStealingEnabled() && !voices.isEmpty())
+        {
+            // A stolen voice is already in the active list.
+            if (auto* stolen = static_cast<MPESamplerVoice*> (findVoiceToSteal(newNote)))
+            {
+                stolen->beginStealFade();
+                startVoice(stolen, newNote);
+                indexVoice(stolen, newNote);
+                stealer.voiceStarted(pool->indexOf(stolen), newNote.initialNote);
+            }
+        }
+    }
+
+    MPESynthesiserVoice* findVoiceToSteal(MPENote noteToStealVoiceFor) const override
+    {
+        const auto index = stealer.findVictim(noteToStealVoiceFor.initialNote);
+        return index < 0 ? nullptr : pool->getVoice(index);
+    }
+
+    // The base class implementations of these all search every voice.
+    void noteReleased(MPENote finishedNote) override
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        forEachVoicePlaying(finishedNote, [this, &finishedNote](MPESamplerVoice& voice)
+            {
+                stopVoice(&voice, finishedNote, true);
+
+                if (voice.isActive())
+                    stealer.voiceReleased(pool->indexOf(&voice));
+            });
+    }
+
+    void notePressureChanged(MPENote changedNote) override
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        forEachVoicePlaying(changedNote, [&changedNote](MPESamplerVoice& voice)
+            {
+                voice.setCurrentlyPlayingNote(changedNote);
+                voice.notePressureChanged();
+            });
+    }
+
+    void notePitchbendChanged(MPENote changedNote) override
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        forEachVoicePlaying(changedNote, [&changedNote](MPESamplerVoice& voice)
+            {
+                voice.setCurrentlyPlayingNote(changedNote);
+                voice.notePitchbendChanged();
+            });
+    }
+
+    void noteTimbreChanged(MPENote changedNote) override
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        forEachVoicePlaying(changedNote, [&changedNote](MPESamplerVoice& voice)
+            {
+                voice.setCurrentlyPlayingNote(changedNote);
+                voice.noteTimbreChanged();
+            });
+    }
+
+    void noteKeyStateChanged(MPENote changedNote) override
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        forEachVoicePlaying(changedNote, [&changedNote](MPESamplerVoice& voice)
+            {
+                voice.setCurrentlyPlayingNote(changedNote);
+                voice.noteKeyStateChanged();
+            });
+    }
+
+    void renderNextSubBlock(juce::AudioBuffer<float>& outputAudio, int startSample, int numSamples) override
+    {
+        renderActiveVoices(outputAudio, startSample, numSamples);
+    }
+
+    void renderNextSubBlock(juce::AudioBuffer<double>& outputAudio, int startSample, int numSamples) override
+    {
+        renderActiveVoices(outputAudio, startSample, numSamples);
+    }
+
+private:
+    template <typename Element>
+    void renderActiveVoices(juce::AudioBuffer<Element>& outputAudio, int startSample, int numSamples)
+    {
+        const juce::ScopedLock sl(voicesLock);
+
+        for (auto* voice : activeVoices)
+            voice->setRenderQuality(renderQuality);
+
+        // Finished voices are only removed once the whole sub-block is done,
+        // so every slice visits the voices in the same order.
+        for (auto offset = 0; offset < numSamples; offset += renderSliceLength)
+        {
+            const auto sliceLength = jmin((int)renderSliceLength, numSamples - offset);
+
+            if (parallelRenderer != nullptr && activeVoices.size() >= minVoicesForParallelRendering)
+            {
+                parallelRenderer->render(activeVoices, outputAudio, startSample + offset, sliceLength);
+                continue;
+            }
+
+            for (auto* voice : activeVoices)
+                if (voice->isActive())
+                    voice->renderNextBlock(outputAudio, startSample + offset, sliceLength);
+        }
+
+        reclaimFinishedVoices(stealer.tracksLevels());
+    }
+
+    MPESamplerVoice* takeFreeVoice()
+    {
+        if (freeVoices.empty())
+            reclaimFinishedVoices(false);
+
+        if (freeVoices.empty())
+            return nullptr;
+
+        auto* voice = freeVoices.back();
+        freeVoices.pop_back();
+        return voice;
+    }
+
+    // Voices can finish on their own (e.g. when they run off the end of the
+    // sample) or be stopped without a tail-off, and we only notice that when
+    // we next look at them.
+    void reclaimFinishedVoices(bool updateLevels)
+    {
+        for (size_t i = 0; i < activeVoices.size();)
+        {
+            auto* voice = activeVoices[i];
+
+            if (voice->isActive())
+            {
+                if (updateLevels)
+                    stealer.voiceLevelChanged(pool->indexOf(voice), voice->getCurrentGain());
+
+                ++i;
+                continue;
+            }
+
+            if (voice->wasCulledEarly())
+                earlyCulls.fetch_add(1, std::memory_order_relaxed);
+
+            if (voice->wasCulledAsSilent())
+                silentCulls.fetch_add(1, std::memory_order_relaxed);
+
+            stealer.voiceStopped(pool->indexOf(voice));
+            activeVoices[i] = activeVoices.back();
+            activeVoices.pop_back();
+            freeVoices.push_back(voice);
+        }
+    }
+
+    //==============================================================================
+    // MPEInstrument builds note IDs from the channel and initial note number,
+    // so they fit comfortably in a small direct-mapped table. Each bucket is
+    // an intrusive doubly-linked list of pool indices, because a note that is
+    // retriggered while its old voice is still tailing off shares its ID.
+    // Voices that have finished on their own are left in place and removed
+    // lazily the next time their bucket is visited.
+    enum { noteIndexSize = 4096 };
+
+    struct NoteIndexLink
+    {
+        int previous = -1;
+        int next = -1;
+        int bucket = -1;
+    };
+
+    static int getBucket(MPENote note) noexcept
+    {
+        return note.noteID & (noteIndexSize - 1);
+    }
+
+    void indexVoice(MPESamplerVoice* voice, MPENote note)
+    {
+        const auto index = pool->indexOf(voice);
+        unindexVoice(index);
+
+        auto& link = noteIndexLinks[(size_t)index];
+        const auto bucket = getBucket(note);
+        auto& head = noteIndexHeads[(size_t)bucket];
+
+        link.bucket = bucket;
+        link.previous = -1;
+        link.next = head;
+
+        if (head >= 0)
+            noteIndexLinks[(size_t)head].previous = index;
+
+        head = index;
+    }
+
+    void unindexVoice(int index)
+    {
+        auto& link = noteIndexLinks[(size_t)index];
+
+        if (link.bucket < 0)
+            return;
+
+        if (link.previous >= 0)
+            noteIndexLinks[(size_t)link.previous].next = link.next;
+        else
+            noteIndexHeads[(size_t)link.bucket] = link.next;
+
+        if (link.next >= 0)
+            noteIndexLinks[(size_t)link.next].previous = link.previous;
+
+        link = {};
+    }
+
+    template <typename Fn>
+    void forEachVoicePlaying(MPENote note, Fn&& fn)
+    {
+        for (auto index = noteIndexHeads[(size_t)getBucket(note)]; index >= 0;)
+        {
+            // fn may stop the voice, so step past it first.
+            const auto next = noteIndexLinks[(size_t)index].next;
+            auto* voice = pool->getVoice(index);
+
+            if (!voice->isActive())
+                unindexVoice(index);
+            else if (voice->isCurrentlyPlayingNote(note))
+                fn(*voice);
+
+            index = next;
+        }
+    }
+
+    std::unique_ptr<VoicePool> pool;
+
+    // Follows the instrument's zone layout. Nothing listens to it.
+    MPEZoneLayout trackedZoneLayout;
+
+    std::array<int, noteIndexSize> noteIndexHeads;
+    std::vector<NoteIndexLink> noteIndexLinks;
+
+    VoiceStealer stealer;
+
+    // With only a couple of voices, waking the workers costs more than it saves.
+    static constexpr size_t minVoicesForParallelRendering = 4;
+    std::unique_ptr<VoiceRenderer> parallelRenderer;
+
+    RenderQuality renderQuality{ RenderQuality::full };
+    std::atomic<juce::uint32> earlyCulls{ 0 };
+    std::atomic<juce::uint32> silentCulls{ 0 };
+
+    // Every enabled voice is in exactly one of these. Both are reserved to
+    // the pool capacity, so they never allocate on the audio thread.
+    std::vector<MPESamplerVoice*> activeVoices;
+    std::vector<MPESamplerVoice*> freeVoices;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SamplerSynthesiser)
+};
@@ -0,0 +1,167 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+enum class FilterType
+{
+    lowPass,
+    highPass,
+    bandPass,
+    notch
+};
+
+//==============================================================================
+// A stereo topology-preserving-transform (zero-delay feedback) state
+// variable filter.
+// Unlike a biquad, the SVF stays well behaved when its cutoff moves every
+// sample, and moving it only needs a tan and a division, so it's fine to
+// drive straight from an envelope. At float precision the tan comes from a
+// rational approximation rather than the library call.
+// All four responses come out of the same two integrators, so the type just
+// selects how they're mixed, and the left and right channels run side by
+// side in two lanes.
+// Type is float or double.
+template <typename Type>
+class StereoStateVariableFilter final
+{
+public:
+    void prepare(double newSampleRate)
+    {
+        jassert(newSampleRate > 0.0);
+        sampleRate = newSampleRate;
+        maxCutoff = (Type)(0.45 * sampleRate);
+        cutoff = -1;
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        ic1eq = {};
+        ic2eq = {};
+    }
+
+    void setType(FilterType newType) noexcept
+    {
+        switch (newType)
+        {
+        case FilterType::highPass: mix = { 0, 0, 1 }; break;
+        case FilterType::bandPass: mix = { 0, 1, 0 }; break;
+        case FilterType::notch:    mix = { 1, 0, 1 }; break;
+        case FilterType::lowPass:
+        default:                   mix = { 1, 0, 0 }; break;
+        }
+    }
+
+    void setResonance(Type q) noexcept
+    {
+        const auto newK = 1 / jmax((Type)0.01, q);
+
+        if (newK != k)
+        {
+            k = newK;
+            updateCoefficients();
+        }
+    }
+
+    // Cheap enough to call every sample, and free if nothing has changed.
+    void setCutoff(Type newCutoff) noexcept
+    {
+        newCutoff = juce::jlimit((Type)10, maxCutoff, newCutoff);
+
+        if (newCutoff == cutoff)
+            return;
+
+        cutoff = newCutoff;
+        g = tangent(juce::MathConstants<Type>::pi * cutoff / (Type)sampleRate);
+        updateCoefficients();
+    }
+
+    void process(Type& left, Type& right) noexcept
+    {
+        const Type v0[2] = { left, right };
+        Type out[2];
+
+        for (auto ch = 0; ch < 2; ++ch)
+        {
+            const auto v3 = v0[ch] - ic2eq[ch];
+            const auto v1 = a1 * ic1eq[ch] + a2 * v3;
+            const auto v2 = ic2eq[ch] + a2 * ic1eq[ch] + a3 * v3;
+
+            ic1eq[ch] = 2 * v1 - ic1eq[ch];
+            ic2eq[ch] = 2 * v2 - ic2eq[ch];
+
+            const auto high = v0[ch] - k * v1 - v2;
+            out[ch] = mix.low * v2 + mix.band * v1 + mix.high * high;
+        }
+
+        left = out[0];
+        right = out[1];
+    }
+
+    // For mono input, which only needs one lane.
+    void processMono(Type& sample) noexcept
+    {
+        const auto v3 = sample - ic2eq[0];
+        const auto v1 = a1 * ic1eq[0] + a2 * v3;
+        const auto v2 = ic2eq[0] + a2 * ic1eq[0] + a3 * v3;
+
+        ic1eq[0] = 2 * v1 - ic1eq[0];
+        ic2eq[0] = 2 * v2 - ic2eq[0];
+
+        const auto high = sample - k * v1 - v2;
+        sample = mix.low * v2 + mix.band * v1 + mix.high * high;
+    }
+
+private:
+    struct Mix
+    {
+        Type low, band, high;
+    };
+
+    // A continued-fraction approximation, accurate to float precision over
+    // the range we need (up to 0.45 of the sample rate).
+    static float tangent(float x) noexcept
+    {
+        const auto x2 = x * x;
+        const auto numerator = x * (135135.0f + x2 * (-17325.0f + x2 * (378.0f - x2)));
+        const auto denominator = 135135.0f + x2 * (-62370.0f + x2 * (3150.0f - 28.0f * x2));
+        return numerator / denominator;
+    }
+
+    static double tangent(double x) noexcept
+    {
+        return std::tan(x);
+    }
+
+    void updateCoefficients() noexcept
+    {
+        a1 = 1 / (1 + g * (g + k));
+        a2 = g * a1;
+        a3 = g * a2;
+    }
+
+    double sampleRate = 44100.0;
+    Type maxCutoff = (Type)19845;
+    Type cutoff = -1;
+
+    Type g = 0;
+    Type k = (Type)1.41421356237309505;   // a Butterworth response
+    Type a1 = 1, a2 = 0, a3 = 0;
+    Mix mix{ 1, 0, 0 };
+
+    std::array<Type, 2> ic1eq{};
+    std::array<Type, 2> ic2eq{};
+};
@@ -0,0 +1,95 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+//==============================================================================
+// A single-writer, single-reader triple buffer.
+// The writer always owns one slot that it can fill at leisure, and publishing
+// swaps that slot with the shared 'middle' slot. The reader swaps the middle
+// slot into its own private slot whenever something new has been published.
+// Neither side ever blocks, spins, or allocates, and the reader always sees
+// the most recently published value, so this is a good fit for handing
+// 'latest value wins' state between the audio thread and the message thread.
+template <typename Value>
+class TripleBuffer final
+{
+public:
+    TripleBuffer() = default;
+
+    explicit TripleBuffer(const Value& initial)
+    {
+        for (auto& slot : slots)
+            slot = initial;
+    }
+
+    //==============================================================================
+    // Writer side. Either fill in getWriteBuffer() and call publish(), or
+    // publish a complete value in one go.
+    Value& getWriteBuffer() noexcept
+    {
+        return slots[(size_t)writeIndex];
+    }
+
+    void publish() noexcept
+    {
+        const auto previous = middle.exchange(writeIndex | dirtyFlag, std::memory_order_acq_rel);
+        writeIndex = previous & indexMask;
+    }
+
+    void publish(const Value& value)
+    {
+        getWriteBuffer() = value;
+        publish();
+    }
+
+    //==============================================================================
+    // Reader side. update() returns true if a new value was published since the
+    // last call, after which read() refers to that value.
+    bool update() noexcept
+    {
+        if ((middle.load(std::memory_order_relaxed) & dirtyFlag) == 0)
+            return false;
+
+        const auto previous = middle.exchange(readIndex, std::memory_order_acq_rel);
+        readIndex = previous & indexMask;
+        return true;
+    }
+
+    const Value& read() const noexcept
+    {
+        return slots[(size_t)readIndex];
+    }
+
+    // Copies the newest value into 'result', but only if it changed.
+    bool pull(Value& result)
+    {
+        if (!update())
+            return false;
+
+        result = read();
+        return true;
+    }
+
+private:
+    enum { indexMask = 3, dirtyFlag = 4 };
+
+    std::array<Value, 3> slots{};
+    int writeIndex = 0;
+    std::atomic<int> middle{ 1 };
+    int readIndex = 2;
+
+    JUCE_DECLARE_NON_COPYABLE(TripleBuffer)
+};
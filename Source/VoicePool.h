@@ -0,0 +1,73 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "MPESamplerVoice.h"
+
+//==============================================================================
+// A fixed-capacity block of voices, all constructed up front in one
+// contiguous allocation on the message thread.
+// The synthesiser borrows voices from here rather than owning them, so
+// changing the polyphony never creates or destroys a voice. The pool must
+// outlive anything that refers to its voices.
+class VoicePool final
+{
+public:
+    VoicePool(int capacityIn,
+        std::shared_ptr<const MPESamplerSound> sound,
+        AudioProcessorValueTreeState& vts)
+        : capacity(jmax(1, capacityIn)),
+        storage(new VoiceStorage[(size_t)capacity])
+    {
+        for (auto i = 0; i != capacity; ++i)
+            new (&storage[(size_t)i]) MPESamplerVoice(sound, vts);
+    }
+
+    ~VoicePool()
+    {
+        for (auto i = 0; i != capacity; ++i)
+            getVoice(i)->~MPESamplerVoice();
+    }
+
+    int getCapacity() const noexcept
+    {
+        return capacity;
+    }
+
+    MPESamplerVoice* getVoice(int index) const noexcept
+    {
+        jassert(juce::isPositiveAndBelow(index, capacity));
+        return std::launder(reinterpret_cast<MPESamplerVoice*> (&storage[(size_t)index]));
+    }
+
+    int indexOf(const MPESamplerVoice* voice) const noexcept
+    {
+        auto index = int(reinterpret_cast<const VoiceStorage*> (voice) - storage.get());
+        jassert(juce::isPositiveAndBelow(index, capacity));
+        return index;
+    }
+
+private:
+    struct alignas(MPESamplerVoice) VoiceStorage
+    {
+        unsigned char bytes[sizeof(MPESamplerVoice)];
+    };
+
+    const int capacity;
+    std::unique_ptr<VoiceStorage[]> storage;
+
+    JUCE_DECLARE_NON_COPYABLE(VoicePool)
+};
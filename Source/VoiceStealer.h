@@ -0,0 +1,315 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+enum class VoiceStealingPolicy
+{
+    oldest,
+    quietest,
+    releasedFirst,
+    sameNoteFirst
+};
+
+//==============================================================================
+// Decides which sounding voice to give up when a new note arrives and every
+// voice is busy.
+// Voices are identified by their index in the VoicePool. Sounding voices are
+// kept in an indexed binary heap ordered by the current policy, so the best
+// victim is always at the top and every update costs O(log n). For the
+// same-note policy, voices are also threaded onto a list per MIDI note, and
+// if nothing is playing the new note we fall back to the oldest voice.
+// Everything is sized up front in prepare(), so nothing here allocates on the
+// audio thread.
+class VoiceStealer final
+{
+public:
+    enum { numPolicies = 4 };
+
+    // Message thread only.
+    void prepare(int capacity)
+    {
+        entries.assign((size_t)capacity, {});
+        heap.clear();
+        heap.reserve((size_t)capacity);
+        sameNoteHeads.fill(-1);
+        nextOrder = 0;
+    }
+
+    void setPolicy(VoiceStealingPolicy newPolicy)
+    {
+        if (newPolicy == policy)
+            return;
+
+        policy = newPolicy;
+
+        // Restore the heap property under the new ordering.
+        for (auto pos = (int)heap.size() / 2; --pos >= 0;)
+            siftDown(pos);
+    }
+
+    VoiceStealingPolicy getPolicy() const noexcept
+    {
+        return policy;
+    }
+
+    // Start tracking a voice, or restart tracking if it was stolen.
+    void voiceStarted(int index, int noteNumber)
+    {
+        auto& entry = entries[(size_t)index];
+        unlinkSameNote(index);
+
+        entry.order = nextOrder++;
+        entry.released = false;
+        entry.level = 1.0f;
+        entry.noteNumber = juce::jlimit(0, 127, noteNumber);
+        linkSameNote(index);
+
+        if (entry.heapPosition < 0)
+        {
+            entry.heapPosition = (int)heap.size();
+            heap.push_back(index);
+            siftUp(entry.heapPosition);
+        }
+        else
+        {
+            update(index);
+        }
+    }
+
+    void voiceReleased(int index)
+    {
+        auto& entry = entries[(size_t)index];
+
+        if (entry.heapPosition < 0 || entry.released)
+            return;
+
+        entry.released = true;
+        update(index);
+    }
+
+    // Only worth calling when the policy looks at levels.
+    void voiceLevelChanged(int index, float level)
+    {
+        auto& entry = entries[(size_t)index];
+
+        if (entry.heapPosition < 0)
+            return;
+
+        entry.level = level;
+        update(index);
+    }
+
+    void voiceStopped(int index)
+    {
+        auto& entry = entries[(size_t)index];
+
+        if (entry.heapPosition < 0)
+            return;
+
+        unlinkSameNote(index);
+
+        const auto pos = entry.heapPosition;
+        const auto last = heap.back();
+        heap.pop_back();
+        entry.heapPosition = -1;
+
+        if (last != index)
+        {
+            heap[(size_t)pos] = last;
+            entries[(size_t)last].heapPosition = pos;
+            siftUp(pos);
+            siftDown(entries[(size_t)last].heapPosition);
+        }
+    }
+
+    bool tracksLevels() const noexcept
+    {
+        return policy == VoiceStealingPolicy::quietest;
+    }
+
+    // Returns the pool index of the voice to steal, or -1 if nothing is sounding.
+    int findVictim(int noteNumber) const
+    {
+        if (policy == VoiceStealingPolicy::sameNoteFirst)
+        {
+            auto best = -1;
+
+            for (auto index = sameNoteHeads[(size_t)juce::jlimit(0, 127, noteNumber)]; index >= 0; index = entries[(size_t)index].nextSameNote)
+                if (best < 0 || entries[(size_t)index].order < entries[(size_t)best].order)
+                    best = index;
+
+            if (best >= 0)
+            {
+                countSteal(VoiceStealingPolicy::sameNoteFirst);
+                return best;
+            }
+
+            // The heap is ordered by age for this policy.
+            if (heap.empty())
+                return -1;
+
+            countSteal(VoiceStealingPolicy::oldest);
+            return heap.front();
+        }
+
+        if (heap.empty())
+            return -1;
+
+        countSteal(policy);
+        return heap.front();
+    }
+
+    juce::uint32 getNumSteals(VoiceStealingPolicy p) const noexcept
+    {
+        return stealCounts[(size_t)p].load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Entry
+    {
+        juce::uint32 order = 0;
+        float level = 0.0f;
+        bool released = false;
+        int noteNumber = 0;
+        int heapPosition = -1;
+        int previousSameNote = -1;
+        int nextSameNote = -1;
+        bool onSameNoteList = false;
+    };
+
+    // True if voice a should be stolen before voice b.
+    bool stealsBefore(int a, int b) const noexcept
+    {
+        const auto& ea = entries[(size_t)a];
+        const auto& eb = entries[(size_t)b];
+
+        switch (policy)
+        {
+        case VoiceStealingPolicy::quietest:
+            if (ea.level != eb.level)
+                return ea.level < eb.level;
+            break;
+
+        case VoiceStealingPolicy::releasedFirst:
+            if (ea.released != eb.released)
+                return ea.released;
+            break;
+
+        case VoiceStealingPolicy::oldest:
+        case VoiceStealingPolicy::sameNoteFirst:
+        default:
+            break;
+        }
+
+        // Wrap-safe comparison of start order.
+        return (juce::int32)(ea.order - eb.order) < 0;
+    }
+
+    void update(int index)
+    {
+        const auto pos = entries[(size_t)index].heapPosition;
+        siftUp(pos);
+        siftDown(entries[(size_t)index].heapPosition);
+    }
+
+    void siftUp(int pos)
+    {
+        while (pos > 0)
+        {
+            const auto parent = (pos - 1) / 2;
+
+            if (!stealsBefore(heap[(size_t)pos], heap[(size_t)parent]))
+                break;
+
+            swapHeapPositions(pos, parent);
+            pos = parent;
+        }
+    }
+
+    void siftDown(int pos)
+    {
+        const auto size = (int)heap.size();
+
+        for (;;)
+        {
+            auto best = pos;
+
+            for (auto child : { 2 * pos + 1, 2 * pos + 2 })
+                if (child < size && stealsBefore(heap[(size_t)child], heap[(size_t)best]))
+                    best = child;
+
+            if (best == pos)
+                break;
+
+            swapHeapPositions(pos, best);
+            pos = best;
+        }
+    }
+
+    void swapHeapPositions(int a, int b)
+    {
+        std::swap(heap[(size_t)a], heap[(size_t)b]);
+        entries[(size_t)heap[(size_t)a]].heapPosition = a;
+        entries[(size_t)heap[(size_t)b]].heapPosition = b;
+    }
+
+    void linkSameNote(int index)
+    {
+        auto& entry = entries[(size_t)index];
+        auto& head = sameNoteHeads[(size_t)entry.noteNumber];
+
+        entry.previousSameNote = -1;
+        entry.nextSameNote = head;
+        entry.onSameNoteList = true;
+
+        if (head >= 0)
+            entries[(size_t)head].previousSameNote = index;
+
+        head = index;
+    }
+
+    void unlinkSameNote(int index)
+    {
+        auto& entry = entries[(size_t)index];
+
+        if (!entry.onSameNoteList)
+            return;
+
+        if (entry.previousSameNote >= 0)
+            entries[(size_t)entry.previousSameNote].nextSameNote = entry.nextSameNote;
+        else
+            sameNoteHeads[(size_t)entry.noteNumber] = entry.nextSameNote;
+
+        if (entry.nextSameNote >= 0)
+            entries[(size_t)entry.nextSameNote].previousSameNote = entry.previousSameNote;
+
+        entry.previousSameNote = entry.nextSameNote = -1;
+        entry.onSameNoteList = false;
+    }
+
+    void countSteal(VoiceStealingPolicy p) const noexcept
+    {
+        stealCounts[(size_t)p].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    VoiceStealingPolicy policy{ VoiceStealingPolicy::oldest };
+    std::vector<Entry> entries;
+    std::vector<int> heap;
+    std::array<int, 128> sameNoteHeads;
+    juce::uint32 nextOrder = 0;
+
+    mutable std::array<std::atomic<juce::uint32>, numPolicies> stealCounts{};
+};
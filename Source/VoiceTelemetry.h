@@ -0,0 +1,83 @@
+/*
+  ==============================================================================
+   This file is part of the JUCE examples.
+   Copyright (c) 2020 - Raw Material Software Limited
+   The code included in this file is provided under the terms of the ISC license
+   http://www.isc.org/downloads/software-support-policy/isc-license. Permission
+   To use, copy, modify, and/or distribute this software for any purpose with or
+   without fee is hereby granted provided that the above copyright notice and
+   this permission notice appear in all copies.
+   THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL WARRANTIES,
+   WHETHER EXPRESSED OR IMPLIED, INCLUDING MERCHANTABILITY AND FITNESS FOR
+   PURPOSE, ARE DISCLAIMED.
+  ==============================================================================
+*/
+
+#pragma once
+
+//==============================================================================
+// What a single voice is doing, as seen from the GUI.
+// Each voice writes its own record from the audio thread at the end of every
+// render call, and any other thread can take a consistent copy at any time.
+// The record is protected by a sequence lock: the writer never waits, and a
+// reader simply retries if it overlapped with a write. Records are padded to a
+// cache line so that neighbouring voices don't fight over the same line.
+class alignas(64) VoiceTelemetry final
+{
+public:
+    struct Snapshot
+    {
+        bool active = false;
+        int noteNumber = -1;
+        float positionSeconds = 0.0f;
+        float envelopeLevel = 0.0f;
+    };
+
+    VoiceTelemetry() = default;
+
+    // Must only be called by the voice that owns this record.
+    void publish(const Snapshot& snapshot) noexcept
+    {
+        const auto seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        active.store(snapshot.active, std::memory_order_relaxed);
+        noteNumber.store(snapshot.noteNumber, std::memory_order_relaxed);
+        positionSeconds.store(snapshot.positionSeconds, std::memory_order_relaxed);
+        envelopeLevel.store(snapshot.envelopeLevel, std::memory_order_relaxed);
+
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    Snapshot read() const noexcept
+    {
+        for (;;)
+        {
+            const auto before = sequence.load(std::memory_order_acquire);
+
+            if ((before & 1) != 0)
+                continue;
+
+            Snapshot result;
+            result.active = active.load(std::memory_order_relaxed);
+            result.noteNumber = noteNumber.load(std::memory_order_relaxed);
+            result.positionSeconds = positionSeconds.load(std::memory_order_relaxed);
+            result.envelopeLevel = envelopeLevel.load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (sequence.load(std::memory_order_relaxed) == before)
+                return result;
+        }
+    }
+
+private:
+    std::atomic<juce::uint32> sequence{ 0 };
+    std::atomic<bool> active{ false };
+    std::atomic<int> noteNumber{ -1 };
+    std::atomic<float> positionSeconds{ 0.0f };
+    std::atomic<float> envelopeLevel{ 0.0f };
+
+    JUCE_DECLARE_NON_COPYABLE(VoiceTelemetry)
+};